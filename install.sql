@@ -4,4 +4,57 @@ CREATE LIBRARY CardinalityEstimators AS :libfile;
 -- Step 2: Create Functions
 CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
 NAME 'EstimateCountDistinctFactory' LIBRARY CardinalityEstimators;
-
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctIntFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctFloatFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctDateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctTimestampFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctTimestampTzFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctNumericFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchIntFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchFloatFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchDateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchTimestampFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchTimestampTzFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchNumericFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_merge AS LANGUAGE 'C++'
+NAME 'HllMergeFactory' LIBRARY CardinalityEstimators;
+CREATE FUNCTION hll_estimate AS LANGUAGE 'C++'
+NAME 'HllEstimateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchIntFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchFloatFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchDateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchTimestampFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchTimestampTzFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchNumericFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_merge AS LANGUAGE 'C++'
+NAME 'KmvMergeFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_union AS LANGUAGE 'C++'
+NAME 'EstimateUnionFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_intersection AS LANGUAGE 'C++'
+NAME 'EstimateIntersectionFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_jaccard AS LANGUAGE 'C++'
+NAME 'EstimateJaccardFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct_hashed AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctHashedFactory' LIBRARY CardinalityEstimators;
@@ -9,82 +9,662 @@
 #include <sstream>
 #include <vector>
 #include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
 #include "CardinalityEstimators.h"
+#include "MurmurHash3.h"
 
 using namespace Vertica;
 using namespace std;
 
 #define VARBINARY_MAX 65000
-#define V_32K_AND_A_BIT 33000
+/* Default precisions (log2 of the sketch size) when USING PARAMETERS does not give one.
+ * One byte per HLL register; 15 is the largest precision whose registers fit into VARBINARY_MAX */
 #define HLL_BITS 13
-#define LPC_BITS (63 * 1024 * 8)
-#define ESTIMATOR_ARG HLL_BITS
-#define EstimatorClass HyperLogLogOwnArrayCounter
+#define LPC_BITS 19
+#define KMV_BITS 12
+#define AGGREGATE_BATCH_SIZE 1024
 
-class EstimateCountDistinct : public AggregateFunction
-{
+/* Estimator, precision and hash chosen with USING PARAMETERS estimator='hll'|'linear'|'kmv', precision=N,
+ * hash='wyhash'|'murmur3'
+ *
+ * precision is log2 of the sketch size: HyperLogLog b, the number of bits of the
+ * linear counter, or KMV's k. The factory sizes the intermediate columns from it,
+ * so cheap low-precision queries do not carry the memory of precise ones.
+ */
+struct EstimatorParams {
+    int kind;
+    int precision;
+    /* hash family of new sketches */
+    int hash_id;
+
+    /* sketch_kind: SKETCH_KIND_* of the sketches the function stores or reads, which then
+     * takes no estimator parameter; 0 for functions returning counts.
+     * merging: the function unions stored sketches, so precision only caps theirs and
+     * defaults to the largest one that can be stored, and the hash comes with them */
+    static EstimatorParams read(ServerInterface &srvInterface, int sketch_kind, bool merging=false) {
+        EstimatorParams params;
+        params.kind = sketch_kind ? sketch_kind : SKETCH_KIND_HYPERLOGLOG;
+        params.hash_id = HASH_DEFAULT;
+        ParamReader paramReader = srvInterface.getParamReader();
+        if (!sketch_kind && paramReader.containsParameter("estimator")) {
+            std::string name = paramReader.getStringRef("estimator").str();
+            if (name == "hll") {
+                params.kind = SKETCH_KIND_HYPERLOGLOG;
+            } else if (name == "linear") {
+                params.kind = SKETCH_KIND_LINEAR;
+            } else if (name == "kmv") {
+                params.kind = SKETCH_KIND_KMV;
+            } else {
+                throw std::runtime_error("estimator must be one of 'hll', 'linear', 'kmv'");
+            }
+        }
+        if (!merging && paramReader.containsParameter("hash")) {
+            std::string name = paramReader.getStringRef("hash").str();
+            if (name == "wyhash") {
+                params.hash_id = HASH_WYHASH;
+            } else if (name == "murmur3") {
+                params.hash_id = HASH_MURMUR3;
+            } else {
+                throw std::runtime_error("hash must be one of 'wyhash', 'murmur3'");
+            }
+        }
+        int precision, min, max;
+        switch (params.kind) {
+            case SKETCH_KIND_LINEAR: precision = LPC_BITS; min = 10; max = 23; break;
+            case SKETCH_KIND_KMV: precision = KMV_BITS; min = 4; max = 17; break;
+            default: precision = HLL_BITS; min = 4; max = 20; break;
+        }
+        if (sketch_kind) {
+            // stored sketches are single VARBINARY values: 15 for HyperLogLog, 12 for KMV
+            for (params.precision = max; params.precision > min && params.sketch_size() > VARBINARY_MAX; params.precision--) {}
+            max = params.precision;
+        }
+        params.precision = merging ? max : precision;
+        if (paramReader.containsParameter("precision")) {
+            params.precision = paramReader.getIntRef("precision");
+        }
+        if (params.precision < min || params.precision > max) {
+            char buf[100];
+            sprintf(buf, "precision must be between %d and %d for this estimator", min, max);
+            throw std::runtime_error(buf);
+        }
+        return params;
+    }
+
+    /* Sketches small enough for one VARBINARY are updated in place */
+    bool in_place() const {
+        return this->sketch_size() <= VARBINARY_MAX;
+    }
 
+    /* Largest serialized size of the sketch, which is also the size of its storage region */
+    size_t sketch_size() const {
+        int n = 1 << this->precision;
+        switch (this->kind) {
+            case SKETCH_KIND_LINEAR: return LinearProbabilisticOwnArrayCounter::storage_capacity(n);
+            case SKETCH_KIND_KMV: return KMinValuesOwnArrayCounter::storage_capacity(n);
+        }
+        return HyperLogLogOwnArrayCounter::storage_capacity(this->precision);
+    }
+
+    int n_columns() const {
+        return (this->sketch_size() + VARBINARY_MAX - 1) / VARBINARY_MAX;
+    }
+
+    /* Size of sketch column i: all but the last one are VARBINARY_MAX */
+    size_t column_size(int i) const {
+        return std::min(this->sketch_size() - (size_t)i * VARBINARY_MAX, (size_t)VARBINARY_MAX);
+    }
+
+    ICardinalityEstimator *create() const {
+        int n = 1 << this->precision;
+        switch (this->kind) {
+            case SKETCH_KIND_LINEAR: return new LinearProbabilisticCounter(n, this->hash_id);
+            case SKETCH_KIND_KMV: return new KMinValuesCounter(n, this->hash_id);
+        }
+        return new HyperLogLogOwnArrayCounter(this->precision, NULL, this->hash_id);
+    }
+
+    /* Estimator working on a storage region prepared with init_storage() */
+    ICardinalityEstimator *create_in_place(char *storage) const {
+        int n = 1 << this->precision;
+        switch (this->kind) {
+            case SKETCH_KIND_LINEAR: return new LinearProbabilisticOwnArrayCounter(n, storage);
+            case SKETCH_KIND_KMV: return new KMinValuesOwnArrayCounter(n, storage);
+        }
+        return new HyperLogLogOwnArrayCounter(this->precision, storage);
+    }
+
+    void init_storage(char *storage) const {
+        int n = 1 << this->precision;
+        switch (this->kind) {
+            case SKETCH_KIND_LINEAR: LinearProbabilisticOwnArrayCounter::init_storage(n, storage, this->hash_id); return;
+            case SKETCH_KIND_KMV: KMinValuesOwnArrayCounter::init_storage(n, storage, this->hash_id); return;
+        }
+        HyperLogLogOwnArrayCounter::init_storage(this->precision, storage, this->hash_id);
+    }
+
+    void add_intermediate_types(SizedColumnTypes &intermediateTypeMetaData) const {
+        intermediateTypeMetaData.addInt("precision");
+        for (int i = 0; i < this->n_columns(); i++) {
+            intermediateTypeMetaData.addVarbinary(this->column_size(i), i == 0 ? "sketch" : "sketch_more");
+        }
+    }
+};
+
+/* The estimator held by an intermediate
+ *
+ * Sketches that fit into one VARBINARY are used in place; other estimators
+ * are unserialized from the sketch columns and serialized back by store().
+ */
+class IntermediateCounter
+{
     public:
 
-    void serialize_counter(ICardinalityEstimator *counter, IntermediateAggs &aggs) {
+    IntermediateCounter(const EstimatorParams &params, IntermediateAggs &aggs): params(params), aggs(aggs) {
+        this->in_place = params.in_place();
+        if (this->in_place) {
+            this->counter = params.create_in_place(aggs.getStringRef(1).data());
+        } else {
+            this->counter = params.create();
+            unserialize_counter(this->counter, aggs, params);
+        }
+    }
+
+    ~IntermediateCounter() {
+        delete this->counter;
+    }
+
+    ICardinalityEstimator *operator->() { return this->counter; }
+    ICardinalityEstimator *get() { return this->counter; }
+
+    /* Looks string hashes up in memo before hashing them */
+    void use_hash_memo(HashMemo *memo) {
+        HashingCardinalityEstimator *hashing = dynamic_cast<HashingCardinalityEstimator *>(this->counter);
+        if (hashing) {
+            hashing->set_hash_memo(memo);
+        }
+    }
+
+    /* Writes an empty sketch into freshly allocated intermediates */
+    static void init(const EstimatorParams &params, IntermediateAggs &aggs) {
+        aggs.getIntRef(0) = params.precision;
+        if (params.in_place()) {
+            // HyperLogLog and KMV regions only need their header: the rest of the
+            // VARBINARY is not touched until the sketch grows into it
+            VString &storage = aggs.getStringRef(1);
+            storage.copy(std::string(sizeof(SketchHeader), '\0'));
+            params.init_storage(storage.data());
+            storage.setLen(sketch_size((const SketchHeader *)storage.data()));
+            return;
+        }
+        ICardinalityEstimator *counter = params.create();
+        serialize_counter(counter, aggs, params);
+        delete counter;
+    }
+
+    void merge_from(MultipleIntermediateAggs &other) {
+        if (this->in_place) {
+            // read in place: the other intermediate is input and is not ours to modify
+            const VString &sketch = other.getStringRef(1);
+            this->merge_sketch(sketch.data(), sketch.length());
+            return;
+        }
+        ICardinalityEstimator *other_counter = this->params.create();
+        unserialize_counter(other_counter, other, this->params);
+        this->counter->merge_from(other_counter);
+        delete other_counter;
+    }
+
+    /* Count of a final intermediate. In-place sketches are read through a view:
+     * terminate() must not write to its input */
+    static int count(const EstimatorParams &params, IntermediateAggs &aggs) {
+        if (!params.in_place()) {
+            IntermediateCounter counter(params, aggs);
+            return counter->count();
+        }
+        const VString &sketch = aggs.getStringRef(1);
+        switch (params.kind) {
+            case SKETCH_KIND_LINEAR: return LinearProbabilisticCounterView(sketch.data(), sketch.length()).count();
+            case SKETCH_KIND_KMV: return KMinValuesView(sketch.data(), sketch.length()).count();
+        }
+        return HyperLogLogView(sketch.data(), sketch.length()).count();
+    }
+
+    /* Unions the counter with a stored sketch of the same kind */
+    void merge_sketch(const char *data, size_t len) {
+        this->take_hash(data, len);
+        switch (this->params.kind) {
+            case SKETCH_KIND_LINEAR:
+                this->merge_view<LinearProbabilisticOwnArrayCounter, LinearProbabilisticCounter,
+                                 LinearProbabilisticCounterView>(data, len);
+                return;
+            case SKETCH_KIND_KMV:
+                this->merge_view<KMinValuesOwnArrayCounter, KMinValuesCounter, KMinValuesView>(data, len);
+                return;
+        }
+        this->merge_view<HyperLogLogOwnArrayCounter, HyperLogLogOwnArrayCounter, HyperLogLogView>(data, len);
+    }
+
+    /* Hands the sketch back to Vertica, recording how much of each column is in use.
+     * pack: bit-pack dense HyperLogLog registers first. combine() asks for it, as its
+     * results are what gets shipped between nodes; the next counter built on the
+     * intermediate unpacks them again */
+    void store(bool pack=false) {
+        if (pack && this->params.kind == SKETCH_KIND_HYPERLOGLOG) {
+            static_cast<HyperLogLogOwnArrayCounter *>(this->counter)->pack();
+        }
+        if (this->in_place) {
+            this->aggs.getStringRef(1).setLen(this->storage_used());
+            return;
+        }
+        serialize_counter(this->counter, this->aggs, this->params);
+    }
+
+    private:
+
+    const EstimatorParams &params;
+    IntermediateAggs &aggs;
+    ICardinalityEstimator *counter;
+    bool in_place;
+
+    /* An in-place region nothing was merged into yet takes the hash family of the first
+     * sketch merged into it, so that sketches built with any family can be merged */
+    void take_hash(const char *data, size_t len) {
+        char *storage = this->aggs.getStringRef(1).data();
+        const SketchHeader *header = (const SketchHeader *)storage;
+        const SketchHeader *other = (const SketchHeader *)data;
+        if (!this->in_place || len < sizeof(SketchHeader) || header->payload_length != 0 ||
+                header->hash_id == other->hash_id) {
+            return;
+        }
+        EstimatorParams params = this->params;
+        params.hash_id = other->hash_id;
+        delete this->counter;
+        this->counter = NULL;
+        params.init_storage(storage);
+        this->counter = params.create_in_place(storage);
+    }
+
+    /* InPlace and Serialized: the counter classes create_in_place() and create() return */
+    template<class InPlace, class Serialized, class View>
+    void merge_view(const char *data, size_t len) {
+        View view(data, len);
+        if (this->in_place) {
+            static_cast<InPlace *>(this->counter)->merge_from(view);
+        } else {
+            static_cast<Serialized *>(this->counter)->merge_from(view);
+        }
+    }
+
+    /* Bytes of the in-place region in use, after folding in anything the counter still holds */
+    size_t storage_used() {
+        switch (this->params.kind) {
+            case SKETCH_KIND_LINEAR:
+                return static_cast<LinearProbabilisticOwnArrayCounter *>(this->counter)->storage_used();
+            case SKETCH_KIND_KMV:
+                return static_cast<KMinValuesOwnArrayCounter *>(this->counter)->storage_used();
+        }
+        return static_cast<HyperLogLogOwnArrayCounter *>(this->counter)->storage_used();
+    }
+
+    /* Serialized estimators are spread over the sketch columns, starting at intermediate column 1 */
+    static void serialize_counter(ICardinalityEstimator *counter, IntermediateAggs &aggs, const EstimatorParams &params) {
         Serializer ser;
-        ser.add_storage(aggs.getStringRef(1).data(), VARBINARY_MAX);
-        //ser.add_storage(aggs.getStringRef(2).data(), VARBINARY_MAX);
-        //ser.add_storage(aggs.getStringRef(3).data(), VARBINARY_MAX);
+        for (int i = 0; i < params.n_columns(); i++) {
+            ser.add_storage(aggs.getStringRef(1 + i).data(), params.column_size(i));
+        }
         counter->serialize(&ser);
+        for (int i = 0; i < params.n_columns(); i++) {
+            aggs.getStringRef(1 + i).setLen(ser.container_used(i));
+        }
     }
 
-    void unserialize_counter(ICardinalityEstimator *counter, IntermediateAggs &aggs) {
+    static void unserialize_counter(ICardinalityEstimator *counter, IntermediateAggs &aggs, const EstimatorParams &params) {
         Serializer ser;
-        ser.add_storage(aggs.getStringRef(1).data(), VARBINARY_MAX);
-        //ser.add_storage(aggs.getStringRef(2).data(), VARBINARY_MAX);
-        //ser.add_storage(aggs.getStringRef(3).data(), VARBINARY_MAX);
+        for (int i = 0; i < params.n_columns(); i++) {
+            VString &column = aggs.getStringRef(1 + i);
+            ser.add_storage(column.data(), column.length());
+        }
         counter->unserialize(&ser);
     }
 
-    void unserialize_counter(ICardinalityEstimator *counter, MultipleIntermediateAggs &aggs) {
+    static void unserialize_counter(ICardinalityEstimator *counter, MultipleIntermediateAggs &aggs, const EstimatorParams &params) {
         Serializer ser;
-        ser.add_storage((char *)aggs.getStringRef(1).data(), VARBINARY_MAX);
-        //ser.add_storage((char *)aggs.getStringRef(2).data(), VARBINARY_MAX);
-        //ser.add_storage((char *)aggs.getStringRef(3).data(), VARBINARY_MAX);
+        for (int i = 0; i < params.n_columns(); i++) {
+            const VString &column = aggs.getStringRef(1 + i);
+            ser.add_storage((char *)column.data(), column.length());
+        }
         counter->unserialize(&ser);
     }
+};
+
+class EstimateCountDistinct : public AggregateFunction
+{
+    protected:
+
+    EstimatorParams params;
+
+    /* Functions that store or read sketches of one kind only accept a precision */
+    virtual int sketch_kind() { return 0; }
+    /* see EstimatorParams::read() */
+    virtual bool merges_sketches() { return false; }
+
+    public:
+
+    virtual void setup(ServerInterface &srvInterface, const SizedColumnTypes &argTypes)
+    {
+        try {
+            this->params = EstimatorParams::read(srvInterface, this->sketch_kind(), this->merges_sketches());
+        } catch(exception& e) {
+            vt_report_error(0, "Invalid parameters: [%s]", e.what());
+        }
+    }
 
     virtual void initAggregate(ServerInterface &srvInterface, IntermediateAggs &aggs)
     {
         try {
-            srvInterface.log("aggregate init");
-            vint &estimator_arg = aggs.getIntRef(0);
-            estimator_arg = ESTIMATOR_ARG;
-            aggs.getStringRef(1).copy(std::string((size_t)V_32K_AND_A_BIT, '\0'));
-            aggs.getStringRef(2).copy(std::string((size_t)V_32K_AND_A_BIT, '\0'));
-            EstimatorClass counter(estimator_arg, aggs.getStringRef(1).data(), aggs.getStringRef(2).data());
-            //aggs.getStringRef(2).copy(std::string((size_t)VARBINARY_MAX, ' '));
-            //aggs.getStringRef(3).copy(std::string((size_t)VARBINARY_MAX, ' '));
-            //this->serialize_counter(&counter, aggs);
+            IntermediateCounter::init(this->params, aggs);
         } catch(exception& e) {
             // Standard exception. Quit.
             vt_report_error(0, "Exception while initializing intermediate aggregates: [%s]", e.what());
         }
     }
 
+    virtual void combine(ServerInterface &srvInterface,
+                         IntermediateAggs &aggs,
+                         MultipleIntermediateAggs &aggsOther)
+    {
+        try {
+            IntermediateCounter counter(this->params, aggs);
+            do {
+                counter.merge_from(aggsOther);
+            } while (aggsOther.next());
+            counter.store(true);
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while combining intermediate aggregates: [%s]", e.what());
+        }
+    }
+
+    virtual void terminate(ServerInterface &srvInterface,
+                           BlockWriter &resWriter,
+                           IntermediateAggs &aggs)
+    {
+        try {
+            resWriter.setInt(IntermediateCounter::count(this->params, aggs));
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while computing aggregate output: [%s]", e.what());
+        }
+    }
+};
+
+class EstimateCountDistinctVarchar : public EstimateCountDistinct
+{
+    protected:
+
+    /* Hashes of the strings seen so far, kept across blocks. A lookup costs about
+     * as much as wyhash, so only MurmurHash3 sketches use one */
+    HashMemo *memo;
+
+    public:
+
+    EstimateCountDistinctVarchar(): memo(NULL) {}
+
+    virtual void setup(ServerInterface &srvInterface, const SizedColumnTypes &argTypes)
+    {
+        EstimateCountDistinct::setup(srvInterface, argTypes);
+        this->memo = (this->params.hash_id == HASH_MURMUR3) ? new HashMemo(this->params.hash_id) : NULL;
+    }
+
+    virtual void destroy(ServerInterface &srvInterface, const SizedColumnTypes &argTypes)
+    {
+        delete this->memo;
+        this->memo = NULL;
+    }
+
     void aggregate(ServerInterface &srvInterface,
                    BlockReader &argReader,
                    IntermediateAggs &aggs)
     {
         try {
-            vint estimator_arg = aggs.getIntRef(0);
-            //EstimatorClass counter(estimator_arg);
-            //EstimatorClass counter(estimator_arg, aggs.getStringRef(1).data());
-            EstimatorClass counter(estimator_arg, aggs.getStringRef(1).data(), aggs.getStringRef(2).data());
-            //this->unserialize_counter(&counter, aggs);
+            IntermediateCounter counter(this->params, aggs);
+            if (this->memo) {
+                counter.use_hash_memo(this->memo);
+            }
 
+            // block values stay in memory for the whole call, so keys can be collected
+            // by pointer and handed to the counter in batches
+            const char *keys[AGGREGATE_BATCH_SIZE];
+            int lengths[AGGREGATE_BATCH_SIZE];
+            int n = 0;
             do {
                 const VString &input = argReader.getStringRef(0);
-                counter.increment(input.data(), input.length());
+                keys[n] = input.data();
+                lengths[n] = input.length();
+                if (++n == AGGREGATE_BATCH_SIZE) {
+                    counter->increment_batch(keys, lengths, n);
+                    n = 0;
+                }
             } while (argReader.next());
+            counter->increment_batch(keys, lengths, n);
+            counter.store();
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while processing aggregate: [%s]", e.what());
+        }
+    }
+
+    InlineAggregate()
+};
+
+/* Input policies for fixed-width argument types.
+ *
+ * read() returns false for NULL, otherwise stores the value's 64-bit pattern in v;
+ * equal SQL values must produce equal patterns.
+ */
+struct IntInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addInt(); }
+    static bool read(BlockReader &argReader, uint64_t &v) {
+        vint x = argReader.getIntRef(0);
+        v = (uint64_t)x;
+        return x != vint_null;
+    }
+};
+
+struct FloatInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addFloat(); }
+    static bool read(BlockReader &argReader, uint64_t &v) {
+        vfloat x = argReader.getFloatRef(0);
+        if (vfloatIsNull(x)) {
+            return false;
+        }
+        if (x == 0.0) {
+            x = 0.0; // -0.0 and 0.0 are the same value
+        }
+        memcpy(&v, &x, sizeof(v));
+        return true;
+    }
+};
+
+struct DateInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addDate(); }
+    static bool read(BlockReader &argReader, uint64_t &v) {
+        DateADT x = argReader.getDateRef(0);
+        v = (uint64_t)x;
+        return x != vint_null;
+    }
+};
+
+struct TimestampInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addTimestamp(); }
+    static bool read(BlockReader &argReader, uint64_t &v) {
+        Timestamp x = argReader.getTimestampRef(0);
+        v = (uint64_t)x;
+        return x != vint_null;
+    }
+};
+
+struct TimestampTzInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addTimestampTz(); }
+    static bool read(BlockReader &argReader, uint64_t &v) {
+        TimestampTz x = argReader.getTimestampTzRef(0);
+        v = (uint64_t)x;
+        return x != vint_null;
+    }
+};
+
+/* NUMERIC(p <= 18) is a single scaled 64-bit word; wider ones are folded into one word by hashing */
+struct NumericInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addNumeric(); }
+    static bool read(BlockReader &argReader, uint64_t &v) {
+        const VNumeric &x = argReader.getNumericRef(0);
+        if (x.isNull()) {
+            return false;
+        }
+        if (x.nwds == 1) {
+            v = x.words[0];
+        } else {
+            uint64_t h[2];
+            MurmurHash3_x64_128(x.words, x.nwds * sizeof(uint64_t), 0, h);
+            v = h[0];
+        }
+        return true;
+    }
+};
+
+/* Counts distinct values of a fixed-width column without converting them to strings */
+template<class Input>
+class EstimateCountDistinctFixed : public EstimateCountDistinct
+{
+    public:
+
+    void aggregate(ServerInterface &srvInterface,
+                   BlockReader &argReader,
+                   IntermediateAggs &aggs)
+    {
+        try {
+            IntermediateCounter counter(this->params, aggs);
 
-            //this->serialize_counter(&counter, aggs);
+            uint64_t values[AGGREGATE_BATCH_SIZE];
+            int n = 0;
+            do {
+                if (Input::read(argReader, values[n]) && ++n == AGGREGATE_BATCH_SIZE) {
+                    counter->increment_int_batch(values, n);
+                    n = 0;
+                }
+            } while (argReader.next());
+            counter->increment_int_batch(values, n);
+            counter.store();
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while processing aggregate: [%s]", e.what());
+        }
+    }
+
+    InlineAggregate()
+};
+
+
+/* Counts distinct 64-bit hashes computed upstream, e.g. at ETL time or with HASH(), without
+ * hashing them again. USING PARAMETERS mix=true runs them through a cheap finaliser first,
+ * for inputs whose low bits are not uniformly distributed */
+class EstimateCountDistinctHashed : public EstimateCountDistinctFixed<IntInput>
+{
+    public:
+
+    virtual void setup(ServerInterface &srvInterface, const SizedColumnTypes &argTypes)
+    {
+        EstimateCountDistinctFixed<IntInput>::setup(srvInterface, argTypes);
+        ParamReader paramReader = srvInterface.getParamReader();
+        if (paramReader.containsParameter("hash")) {
+            vt_report_error(0, "Invalid parameters: [values are hashed already, pass mix=true for poorly mixed ones]");
+        }
+        bool mix = paramReader.containsParameter("mix") && paramReader.getBoolRef("mix") == vbool_true;
+        this->params.hash_id = mix ? HASH_PREHASHED_FMIX : HASH_PREHASHED;
+    }
+};
+
+/* Turns an estimator aggregate into one that returns the sketch instead of the count */
+template<class Base>
+class HllSketch : public Base
+{
+    protected:
+
+    virtual int sketch_kind() { return SKETCH_KIND_HYPERLOGLOG; }
+
+    public:
+
+    virtual void terminate(ServerInterface &srvInterface,
+                           BlockWriter &resWriter,
+                           IntermediateAggs &aggs)
+    {
+        try {
+            // terminate() must not write to its input, so the output copy is what gets packed
+            const VString &intermediate = aggs.getStringRef(1);
+            VString &sketch = resWriter.getStringRef();
+            sketch.copy(intermediate.data(), intermediate.length());
+            // hll_merge() intermediates can have a lower precision than the parameter
+            HyperLogLogOwnArrayCounter counter(((const SketchHeader *)sketch.data())->param, sketch.data());
+            counter.pack();
+            sketch.setLen(counter.storage_used());
+            // stored sketches carry a checksum, verified whenever they are read back
+            sketch_seal((SketchHeader *)sketch.data());
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while computing aggregate output: [%s]", e.what());
+        }
+    }
+};
+
+/* Unions sketches produced by hll_sketch()
+ *
+ * The intermediate has room for params.precision, but takes the precision (up to that)
+ * and the hash family of the first sketch merged into it. Sketches of higher precision
+ * are folded down to the intermediate's, and one of lower precision folds the
+ * intermediate down to its own, so sketches of any precision can be merged together.
+ */
+class HllMerge : public EstimateCountDistinct
+{
+    protected:
+
+    virtual bool merges_sketches() { return true; }
+
+    /* Unions a sketch into the intermediate's region. A counter over the region costs
+     * next to nothing to set up, so there is one per sketch */
+    void merge_sketch(VString &region, const HyperLogLogView &sketch)
+    {
+        SketchHeader *header = (SketchHeader *)region.data();
+        int b = std::min(sketch.b(), this->params.precision);
+        if (header->payload_length == 0) {
+            // nothing merged yet
+            HyperLogLogOwnArrayCounter::init_storage(b, region.data(), sketch.header->hash_id);
+        } else if (b < (int)header->param) {
+            std::vector<char> copy(region.data(), region.data() + sketch_size(header));
+            HyperLogLogOwnArrayCounter::init_storage(b, region.data(), header->hash_id);
+            HyperLogLogOwnArrayCounter(b, region.data()).merge_from(HyperLogLogView(&copy[0], copy.size()));
+        }
+        HyperLogLogOwnArrayCounter(header->param, region.data()).merge_from(sketch);
+        region.setLen(sketch_size(header));
+    }
+
+    public:
+
+    void aggregate(ServerInterface &srvInterface,
+                   BlockReader &argReader,
+                   IntermediateAggs &aggs)
+    {
+        try {
+            VString &region = aggs.getStringRef(1);
+            do {
+                const VString &sketch = argReader.getStringRef(0);
+                if (sketch.isNull()) {
+                    continue;
+                }
+                this->merge_sketch(region, HyperLogLogView(sketch.data(), sketch.length()));
+            } while (argReader.next());
         } catch(exception& e) {
             // Standard exception. Quit.
             vt_report_error(0, "Exception while processing aggregate: [%s]", e.what());
@@ -96,45 +676,81 @@ class EstimateCountDistinct : public AggregateFunction
                          MultipleIntermediateAggs &aggsOther)
     {
         try {
-            vint estimator_arg = aggs.getIntRef(0);
-            //EstimatorClass counter(estimator_arg, aggs.getStringRef(1).data());
-            EstimatorClass counter(estimator_arg, aggs.getStringRef(1).data(), aggs.getStringRef(2).data());
-            //EstimatorClass counter(estimator_arg);
-            //this->unserialize_counter(&counter, aggs);
-
+            VString &region = aggs.getStringRef(1);
             do {
-                //EstimatorClass other_counter(estimator_arg);
-                //EstimatorClass other_counter(estimator_arg, (char *)aggsOther.getStringRef(1).data());
-                EstimatorClass other_counter(estimator_arg, (char *)aggsOther.getStringRef(1).data(), (char *)aggsOther.getStringRef(2).data());
-                //this->unserialize_counter(&other_counter, aggsOther);
-                counter.merge_from(&other_counter);
+                const VString &other = aggsOther.getStringRef(1);
+                this->merge_sketch(region, HyperLogLogView(other.data(), other.length()));
             } while (aggsOther.next());
-
-            //this->serialize_counter(&counter, aggs);
+            // see IntermediateCounter::store()
+            SketchHeader *header = (SketchHeader *)region.data();
+            HyperLogLogOwnArrayCounter(header->param, region.data()).pack();
+            region.setLen(sketch_size(header));
         } catch(exception& e) {
             // Standard exception. Quit.
             vt_report_error(0, "Exception while combining intermediate aggregates: [%s]", e.what());
         }
     }
 
+    InlineAggregate()
+};
+
+/* Turns an estimator aggregate into one that returns a KMV sketch */
+template<class Base>
+class KmvSketch : public Base
+{
+    protected:
+
+    virtual int sketch_kind() { return SKETCH_KIND_KMV; }
+
+    public:
+
     virtual void terminate(ServerInterface &srvInterface,
                            BlockWriter &resWriter,
                            IntermediateAggs &aggs)
     {
         try {
-            vint estimator_arg = aggs.getIntRef(0);
-            //EstimatorClass counter(estimator_arg, aggs.getStringRef(1).data());
-            EstimatorClass counter(estimator_arg, (char *)aggs.getStringRef(1).data(), (char *)aggs.getStringRef(2).data());
-            //EstimatorClass counter(estimator_arg);
-            //this->unserialize_counter(&counter, aggs);
-
-            int count = counter.count();
-            resWriter.setInt(count);
+            IntermediateCounter counter(this->params, aggs);
+            std::vector<char> data(this->params.sketch_size());
+            Serializer ser;
+            ser.add_storage(&data[0], data.size());
+            // serialize() checksums the values
+            counter->serialize(&ser);
+            resWriter.getStringRef().copy(&data[0], ser.size());
         } catch(exception& e) {
             // Standard exception. Quit.
             vt_report_error(0, "Exception while computing aggregate output: [%s]", e.what());
         }
     }
+};
+
+/* Unions sketches produced by kmv_sketch() */
+class KmvMerge : public EstimateCountDistinct
+{
+    protected:
+
+    virtual bool merges_sketches() { return true; }
+
+    public:
+
+    void aggregate(ServerInterface &srvInterface,
+                   BlockReader &argReader,
+                   IntermediateAggs &aggs)
+    {
+        try {
+            IntermediateCounter counter(this->params, aggs);
+            do {
+                const VString &sketch = argReader.getStringRef(0);
+                if (sketch.isNull()) {
+                    continue;
+                }
+                counter.merge_sketch(sketch.data(), sketch.length());
+            } while (argReader.next());
+            counter.store();
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while processing aggregate: [%s]", e.what());
+        }
+    }
 
     InlineAggregate()
 };
@@ -142,12 +758,30 @@ class EstimateCountDistinct : public AggregateFunction
 
 class EstimateCountDistinctFactory : public AggregateFunctionFactory
 {
+    protected:
+
+    /* see EstimateCountDistinct::sketch_kind() and merges_sketches() */
+    virtual int sketch_kind() { return 0; }
+    virtual bool merges_sketches() { return false; }
+
+    virtual void getParameterType(ServerInterface &srvInterface, SizedColumnTypes &parameterTypes)
+    {
+        parameterTypes.addInt("precision");
+        if (!this->sketch_kind()) {
+            parameterTypes.addVarchar(16, "estimator");
+        }
+        if (!this->merges_sketches()) {
+            parameterTypes.addVarchar(16, "hash");
+        }
+    }
+
     virtual void getIntermediateTypes(ServerInterface &srvInterface, const SizedColumnTypes &inputTypes, SizedColumnTypes &intermediateTypeMetaData)
     {
-        intermediateTypeMetaData.addInt("b");
-        intermediateTypeMetaData.addVarbinary(V_32K_AND_A_BIT, "storage0");
-        intermediateTypeMetaData.addVarbinary(V_32K_AND_A_BIT, "storage1");
-        //intermediateTypeMetaData.addVarbinary(VARBINARY_MAX, "storage2");
+        try {
+            EstimatorParams::read(srvInterface, this->sketch_kind(), this->merges_sketches()).add_intermediate_types(intermediateTypeMetaData);
+        } catch(exception& e) {
+            vt_report_error(0, "Invalid parameters: [%s]", e.what());
+        }
     }
 
     virtual void getPrototype(ServerInterface &srvfloaterface, ColumnTypes &argTypes, ColumnTypes &returnType)
@@ -164,9 +798,362 @@ class EstimateCountDistinctFactory : public AggregateFunctionFactory
     }
 
     virtual AggregateFunction *createAggregateFunction(ServerInterface &srvfloaterface)
-    { return vt_createFuncObj(srvfloaterface.allocator, EstimateCountDistinct); }
+    { return vt_createFuncObj(srvfloaterface.allocator, EstimateCountDistinctVarchar); }
 
 };
 
 RegisterFactory(EstimateCountDistinctFactory);
 
+/* Return type policies */
+struct CountOutput {
+    static const int sketch_kind = 0;
+    static void addReturnType(ColumnTypes &returnType) { returnType.addInt(); }
+    static void addOutputType(const EstimatorParams &params, SizedColumnTypes &outputTypes) {
+        outputTypes.addInt("est_count");
+    }
+};
+
+template<int Kind>
+struct SketchOutput {
+    static const int sketch_kind = Kind;
+    static void addReturnType(ColumnTypes &returnType) { returnType.addVarbinary(); }
+    static void addOutputType(const EstimatorParams &params, SizedColumnTypes &outputTypes) {
+        outputTypes.addVarbinary(params.sketch_size(), "sketch");
+    }
+};
+
+typedef SketchOutput<SKETCH_KIND_HYPERLOGLOG> HllSketchOutput;
+typedef SketchOutput<SKETCH_KIND_KMV> KmvSketchOutput;
+
+/* Argument type policies for functions whose aggregate() does not need one */
+struct VarcharInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addVarchar(); }
+};
+
+struct SketchInput {
+    static void addArgType(ColumnTypes &argTypes) { argTypes.addVarbinary(); }
+};
+
+/* Factory for one overload of an estimator aggregate; all of them share the intermediates
+ * of estimate_count_distinct(VARCHAR) */
+template<class Aggregate, class Input, class Output>
+class EstimatorAggregateFactory : public EstimateCountDistinctFactory
+{
+    virtual int sketch_kind() { return Output::sketch_kind; }
+
+    virtual void getPrototype(ServerInterface &srvfloaterface, ColumnTypes &argTypes, ColumnTypes &returnType)
+    {
+        Input::addArgType(argTypes);
+        Output::addReturnType(returnType);
+    }
+
+    virtual void getReturnType(ServerInterface &srvInterface,
+                               const SizedColumnTypes &inputTypes,
+                               SizedColumnTypes &outputTypes)
+    {
+        try {
+            Output::addOutputType(EstimatorParams::read(srvInterface, this->sketch_kind(), this->merges_sketches()), outputTypes);
+        } catch(exception& e) {
+            vt_report_error(0, "Invalid parameters: [%s]", e.what());
+        }
+    }
+
+    virtual AggregateFunction *createAggregateFunction(ServerInterface &srvfloaterface)
+    { return vt_createFuncObj(srvfloaterface.allocator, Aggregate); }
+};
+
+/* estimate_count_distinct_hashed(hash) */
+class EstimateCountDistinctHashedFactory : public EstimatorAggregateFactory<EstimateCountDistinctHashed, IntInput, CountOutput>
+{
+    virtual void getParameterType(ServerInterface &srvInterface, SizedColumnTypes &parameterTypes)
+    {
+        EstimatorAggregateFactory<EstimateCountDistinctHashed, IntInput, CountOutput>::getParameterType(srvInterface, parameterTypes);
+        parameterTypes.addBool("mix");
+    }
+};
+
+RegisterFactory(EstimateCountDistinctHashedFactory);
+
+/* Overloads of estimate_count_distinct for fixed-width types */
+class EstimateCountDistinctIntFactory : public EstimatorAggregateFactory<EstimateCountDistinctFixed<IntInput>, IntInput, CountOutput> {};
+class EstimateCountDistinctFloatFactory : public EstimatorAggregateFactory<EstimateCountDistinctFixed<FloatInput>, FloatInput, CountOutput> {};
+class EstimateCountDistinctDateFactory : public EstimatorAggregateFactory<EstimateCountDistinctFixed<DateInput>, DateInput, CountOutput> {};
+class EstimateCountDistinctTimestampFactory : public EstimatorAggregateFactory<EstimateCountDistinctFixed<TimestampInput>, TimestampInput, CountOutput> {};
+class EstimateCountDistinctTimestampTzFactory : public EstimatorAggregateFactory<EstimateCountDistinctFixed<TimestampTzInput>, TimestampTzInput, CountOutput> {};
+class EstimateCountDistinctNumericFactory : public EstimatorAggregateFactory<EstimateCountDistinctFixed<NumericInput>, NumericInput, CountOutput> {};
+
+RegisterFactory(EstimateCountDistinctIntFactory);
+RegisterFactory(EstimateCountDistinctFloatFactory);
+RegisterFactory(EstimateCountDistinctDateFactory);
+RegisterFactory(EstimateCountDistinctTimestampFactory);
+RegisterFactory(EstimateCountDistinctTimestampTzFactory);
+RegisterFactory(EstimateCountDistinctNumericFactory);
+
+/* hll_sketch(x): the sketch itself, for storing and merging later with hll_merge() */
+class HllSketchFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctVarchar>, VarcharInput, HllSketchOutput> {};
+class HllSketchIntFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctFixed<IntInput> >, IntInput, HllSketchOutput> {};
+class HllSketchFloatFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctFixed<FloatInput> >, FloatInput, HllSketchOutput> {};
+class HllSketchDateFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctFixed<DateInput> >, DateInput, HllSketchOutput> {};
+class HllSketchTimestampFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctFixed<TimestampInput> >, TimestampInput, HllSketchOutput> {};
+class HllSketchTimestampTzFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctFixed<TimestampTzInput> >, TimestampTzInput, HllSketchOutput> {};
+class HllSketchNumericFactory : public EstimatorAggregateFactory<HllSketch<EstimateCountDistinctFixed<NumericInput> >, NumericInput, HllSketchOutput> {};
+
+RegisterFactory(HllSketchFactory);
+RegisterFactory(HllSketchIntFactory);
+RegisterFactory(HllSketchFloatFactory);
+RegisterFactory(HllSketchDateFactory);
+RegisterFactory(HllSketchTimestampFactory);
+RegisterFactory(HllSketchTimestampTzFactory);
+RegisterFactory(HllSketchNumericFactory);
+
+/* hll_merge(sketch): union of stored sketches, as a sketch */
+class HllMergeFactory : public EstimatorAggregateFactory<HllSketch<HllMerge>, SketchInput, HllSketchOutput>
+{
+    virtual bool merges_sketches() { return true; }
+};
+
+RegisterFactory(HllMergeFactory);
+
+/* kmv_sketch(x): KMV sketch, for kmv_merge() and the estimate_union/intersection/jaccard aggregates */
+class KmvSketchFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctVarchar>, VarcharInput, KmvSketchOutput> {};
+class KmvSketchIntFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctFixed<IntInput> >, IntInput, KmvSketchOutput> {};
+class KmvSketchFloatFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctFixed<FloatInput> >, FloatInput, KmvSketchOutput> {};
+class KmvSketchDateFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctFixed<DateInput> >, DateInput, KmvSketchOutput> {};
+class KmvSketchTimestampFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctFixed<TimestampInput> >, TimestampInput, KmvSketchOutput> {};
+class KmvSketchTimestampTzFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctFixed<TimestampTzInput> >, TimestampTzInput, KmvSketchOutput> {};
+class KmvSketchNumericFactory : public EstimatorAggregateFactory<KmvSketch<EstimateCountDistinctFixed<NumericInput> >, NumericInput, KmvSketchOutput> {};
+
+RegisterFactory(KmvSketchFactory);
+RegisterFactory(KmvSketchIntFactory);
+RegisterFactory(KmvSketchFloatFactory);
+RegisterFactory(KmvSketchDateFactory);
+RegisterFactory(KmvSketchTimestampFactory);
+RegisterFactory(KmvSketchTimestampTzFactory);
+RegisterFactory(KmvSketchNumericFactory);
+
+/* kmv_merge(sketch): union of stored KMV sketches, as a sketch */
+class KmvMergeFactory : public EstimatorAggregateFactory<KmvSketch<KmvMerge>, SketchInput, KmvSketchOutput>
+{
+    virtual bool merges_sketches() { return true; }
+};
+
+RegisterFactory(KmvMergeFactory);
+
+
+/* Result policies of the KMV overlap aggregates */
+struct UnionResult {
+    static void addReturnType(ColumnTypes &returnType) { returnType.addInt(); }
+    static void addOutputType(SizedColumnTypes &outputTypes) { outputTypes.addInt("est_union"); }
+    static void write(const KMinValuesOverlap &overlap, BlockWriter &resWriter) { resWriter.setInt(overlap.union_count()); }
+};
+
+struct IntersectionResult {
+    static void addReturnType(ColumnTypes &returnType) { returnType.addInt(); }
+    static void addOutputType(SizedColumnTypes &outputTypes) { outputTypes.addInt("est_intersection"); }
+    static void write(const KMinValuesOverlap &overlap, BlockWriter &resWriter) { resWriter.setInt(overlap.intersection_count()); }
+};
+
+struct JaccardResult {
+    static void addReturnType(ColumnTypes &returnType) { returnType.addFloat(); }
+    static void addOutputType(SizedColumnTypes &outputTypes) { outputTypes.addFloat("est_jaccard"); }
+    static void write(const KMinValuesOverlap &overlap, BlockWriter &resWriter) { resWriter.setFloat(overlap.jaccard()); }
+};
+
+/* Union, intersection or Jaccard index of the KMV sketches in a group
+ *
+ * The intermediate is a serialized KMinValuesOverlap; precision caps its k and
+ * sketches with a smaller k lower it.
+ */
+template<class Result>
+class KmvOverlap : public AggregateFunction
+{
+    protected:
+
+    EstimatorParams params;
+
+    static void load(KMinValuesOverlap &overlap, const VString &state) {
+        Serializer ser;
+        ser.add_storage((char *)state.data(), state.length());
+        overlap.unserialize(&ser);
+    }
+
+    void store(KMinValuesOverlap &overlap, IntermediateAggs &aggs) {
+        VString &state = aggs.getStringRef(1);
+        Serializer ser;
+        ser.add_storage(state.data(), KMinValuesOverlap::serialized_size(1 << this->params.precision));
+        overlap.serialize(&ser);
+        state.setLen(ser.size());
+    }
+
+    public:
+
+    virtual void setup(ServerInterface &srvInterface, const SizedColumnTypes &argTypes)
+    {
+        try {
+            this->params = EstimatorParams::read(srvInterface, SKETCH_KIND_KMV);
+        } catch(exception& e) {
+            vt_report_error(0, "Invalid parameters: [%s]", e.what());
+        }
+    }
+
+    virtual void initAggregate(ServerInterface &srvInterface, IntermediateAggs &aggs)
+    {
+        try {
+            aggs.getIntRef(0) = this->params.precision;
+            KMinValuesOverlap overlap(1 << this->params.precision);
+            store(overlap, aggs);
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while initializing intermediate aggregates: [%s]", e.what());
+        }
+    }
+
+    void aggregate(ServerInterface &srvInterface,
+                   BlockReader &argReader,
+                   IntermediateAggs &aggs)
+    {
+        try {
+            KMinValuesOverlap overlap(1 << this->params.precision);
+            load(overlap, aggs.getStringRef(1));
+            do {
+                const VString &sketch = argReader.getStringRef(0);
+                if (sketch.isNull()) {
+                    continue;
+                }
+                overlap.add(KMinValuesView(sketch.data(), sketch.length()));
+            } while (argReader.next());
+            store(overlap, aggs);
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while processing aggregate: [%s]", e.what());
+        }
+    }
+
+    virtual void combine(ServerInterface &srvInterface,
+                         IntermediateAggs &aggs,
+                         MultipleIntermediateAggs &aggsOther)
+    {
+        try {
+            KMinValuesOverlap overlap(1 << this->params.precision);
+            load(overlap, aggs.getStringRef(1));
+            do {
+                KMinValuesOverlap other(1 << this->params.precision);
+                load(other, aggsOther.getStringRef(1));
+                overlap.merge_from(other);
+            } while (aggsOther.next());
+            store(overlap, aggs);
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while combining intermediate aggregates: [%s]", e.what());
+        }
+    }
+
+    virtual void terminate(ServerInterface &srvInterface,
+                           BlockWriter &resWriter,
+                           IntermediateAggs &aggs)
+    {
+        try {
+            KMinValuesOverlap overlap(1 << this->params.precision);
+            load(overlap, aggs.getStringRef(1));
+            Result::write(overlap, resWriter);
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while computing aggregate output: [%s]", e.what());
+        }
+    }
+
+    InlineAggregate()
+};
+
+template<class Result>
+class KmvOverlapFactory : public AggregateFunctionFactory
+{
+    virtual void getParameterType(ServerInterface &srvInterface, SizedColumnTypes &parameterTypes)
+    {
+        parameterTypes.addInt("precision");
+    }
+
+    virtual void getIntermediateTypes(ServerInterface &srvInterface, const SizedColumnTypes &inputTypes, SizedColumnTypes &intermediateTypeMetaData)
+    {
+        try {
+            EstimatorParams params = EstimatorParams::read(srvInterface, SKETCH_KIND_KMV);
+            intermediateTypeMetaData.addInt("precision");
+            intermediateTypeMetaData.addVarbinary(KMinValuesOverlap::serialized_size(1 << params.precision), "overlap");
+        } catch(exception& e) {
+            vt_report_error(0, "Invalid parameters: [%s]", e.what());
+        }
+    }
+
+    virtual void getPrototype(ServerInterface &srvInterface, ColumnTypes &argTypes, ColumnTypes &returnType)
+    {
+        argTypes.addVarbinary();
+        Result::addReturnType(returnType);
+    }
+
+    virtual void getReturnType(ServerInterface &srvInterface,
+                               const SizedColumnTypes &inputTypes,
+                               SizedColumnTypes &outputTypes)
+    {
+        Result::addOutputType(outputTypes);
+    }
+
+    virtual AggregateFunction *createAggregateFunction(ServerInterface &srvInterface)
+    { return vt_createFuncObj(srvInterface.allocator, KmvOverlap<Result>); }
+};
+
+/* estimate_union/intersection/jaccard(sketch): overlap of the kmv_sketch() values in a group */
+class EstimateUnionFactory : public KmvOverlapFactory<UnionResult> {};
+class EstimateIntersectionFactory : public KmvOverlapFactory<IntersectionResult> {};
+class EstimateJaccardFactory : public KmvOverlapFactory<JaccardResult> {};
+
+RegisterFactory(EstimateUnionFactory);
+RegisterFactory(EstimateIntersectionFactory);
+RegisterFactory(EstimateJaccardFactory);
+
+
+/* hll_estimate(sketch): distinct count of a stored sketch */
+class HllEstimate : public ScalarFunction
+{
+    public:
+
+    virtual void processBlock(ServerInterface &srvInterface,
+                              BlockReader &argReader,
+                              BlockWriter &resWriter)
+    {
+        try {
+            do {
+                const VString &sketch = argReader.getStringRef(0);
+                if (sketch.isNull()) {
+                    resWriter.setNull();
+                } else {
+                    resWriter.setInt(HyperLogLogView(sketch.data(), sketch.length()).count());
+                }
+                resWriter.next();
+            } while (argReader.next());
+        } catch(exception& e) {
+            // Standard exception. Quit.
+            vt_report_error(0, "Exception while estimating sketch: [%s]", e.what());
+        }
+    }
+};
+
+class HllEstimateFactory : public ScalarFunctionFactory
+{
+    virtual void getPrototype(ServerInterface &srvInterface, ColumnTypes &argTypes, ColumnTypes &returnType)
+    {
+        argTypes.addVarbinary();
+        returnType.addInt();
+    }
+
+    virtual void getReturnType(ServerInterface &srvInterface,
+                               const SizedColumnTypes &inputTypes,
+                               SizedColumnTypes &outputTypes)
+    {
+        outputTypes.addInt("est_count");
+    }
+
+    virtual ScalarFunction *createScalarFunction(ServerInterface &srvInterface)
+    { return vt_createFuncObj(srvInterface.allocator, HllEstimate); }
+};
+
+RegisterFactory(HllEstimateFactory);
@@ -1,19 +1,21 @@
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
-#include <queue>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <climits>
 #include <stdint.h>
 
-#include "MurmurHash3.h"
 #include "CardinalityEstimators.h"
+#include "RegisterKernels.h"
 
 /******** Utilities *******/
 
+#ifndef UINT64_MAX
 #define UINT64_MAX (18446744073709551615ULL)
+#endif
 
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
@@ -53,43 +55,243 @@ int constrain_int(int v, int min, int max) {
     return v;
 }
 
-/* Counts the length of the run of `one` bits starting from the least significant bits
- * TODO: probably can be crazily optimized
+/* HyperLogLog rank of the hash bits left after taking the register index:
+ * the 1-based position of the lowest zero bit, i.e. the number of trailing
+ * ones plus one. A register holding r has seen a hash whose rank was r, which
+ * happens with probability 2^-r. val always has zero bits above the 64 - b
+ * hash bits it was shifted from, so the rank is at most 64 - b + 1.
  */
-inline int count_run_of_ones(uint64_t val) {
-    int n = 0;
-    while (val) {
-        if (val & 1) {
-            n++;
-            val = val >> 1;
-        } else {
-            break;
-        }
+inline int hll_rank(uint64_t val) {
+    return __builtin_ctzll(~val) + 1;
+}
+
+/* sigma() and tau() from Ertl, "New cardinality estimation algorithms for
+ * HyperLogLog sketches" (2017), correcting for registers stuck at 0 and at
+ * the maximum rank respectively
+ */
+static double hll_sigma(double x) {
+    if (x == 1.0) {
+        return INFINITY;
+    }
+    double y = 1.0;
+    double z = x;
+    double z_prev;
+    do {
+        x *= x;
+        z_prev = z;
+        z += x * y;
+        y += y;
+    } while (z != z_prev);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0.0 || x == 1.0) {
+        return 0.0;
     }
-    /* HACK: this '+1' should not be here, and compensates for some unknown bug
-     * elsewhere in the code, which I was not able to locate */
-    return n + 1;
+    double y = 1.0;
+    double z = 1.0 - x;
+    double z_prev;
+    do {
+        x = sqrt(x);
+        z_prev = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (z != z_prev);
+    return z / 3.0;
+}
+
+/* Improved raw estimator by Ertl over the register histogram: hist[r] is the
+ * number of the 2^b registers holding r. Unlike the classic alpha * m^2 / sum
+ * with linear counting below 2.5m, it needs no empirical bias tables and no
+ * switch-over point, so it has no bias bump in the transition range and
+ * stays unbiased for both tiny and very large counts.
+ */
+static int hll_estimate(const uint32_t *hist, int b) {
+    const double m = double(1 << b);
+    const int q = 64 - b;
+    // ranks above q + 1 only come from corrupt input; count them as saturated
+    double saturated = 0;
+    for (int r = q + 1; r < 256; r++) {
+        saturated += hist[r];
+    }
+    double z = m * hll_tau(1.0 - saturated / m);
+    for (int r = q; r >= 1; r--) {
+        z = 0.5 * (z + hist[r]);
+    }
+    z += m * hll_sigma(hist[0] / m);
+    /* alpha_inf = 1 / (2 ln 2) */
+    double estimate = m * m / (2.0 * M_LN2 * z);
+    return (estimate < (double)INT_MAX) ? (int)(estimate + 0.5) : INT_MAX;
 }
 
 /******** HashingCardinalityEstimator ********/
 
+HashingCardinalityEstimator::HashingCardinalityEstimator(int hash_id) {
+    this->hasher = get_hash_function(hash_id);
+    this->memo = NULL;
+}
+
+int HashingCardinalityEstimator::hash_function_id() {
+    return this->hasher->id;
+}
+
+void HashingCardinalityEstimator::set_hash_memo(HashMemo *memo) {
+    if (memo && memo->hash_function() != this->hasher) {
+        throw std::runtime_error("hash memo uses a different hash function");
+    }
+    this->memo = memo;
+}
+
+void HashingCardinalityEstimator::check_same_hash(HashingCardinalityEstimator *other) {
+    if (this->hasher != other->hasher) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
+    }
+}
+
 uint64_t HashingCardinalityEstimator::hash(const char *key) {
-    int key_len = strlen(key);
-    uint64_t h[2];
-    MurmurHash3_x64_128(key, key_len, 0, &h[0]);
-    return h[0];
+    return this->hasher->hash(key, strlen(key));
 }
 
 uint64_t HashingCardinalityEstimator::hash(const char *key, int key_len) {
-    uint64_t h[2];
-    MurmurHash3_x64_128(key, key_len, 0, &h[0]);
-    return h[0];
+    return this->hasher->hash(key, key_len);
+}
+
+/* Produces the same values as hash(keys[i], lengths[i]), several keys at a time */
+void HashingCardinalityEstimator::hash_batch(const char * const *keys, const int *lengths, int n, uint64_t *hashes) {
+    if (this->memo) {
+        this->memo->hash_batch(keys, lengths, n, hashes);
+        return;
+    }
+    this->hasher->hash_batch(keys, lengths, n, hashes);
+}
+
+/* Fixed-width values only need their bits spread over the whole word, not a full string hash */
+void HashingCardinalityEstimator::hash_int_batch(const uint64_t *values, int n, uint64_t *hashes) {
+    this->hasher->hash_int_batch(values, n, hashes);
+}
+
+/* Pointer equality first, then the last byte, where sequential keys tend to differ, then memcmp */
+static inline bool same_key(const char *a, const char *b, int len_a, int len_b) {
+    if (len_a != len_b) {
+        return false;
+    }
+    if (a == b || len_a == 0) {
+        return true;
+    }
+    return a[len_a - 1] == b[len_a - 1] && memcmp(a, b, len_a - 1) == 0;
+}
+
+/*
+ * Sorted and RLE-encoded input repeats values back to back. A repeated value
+ * cannot change any sketch, so a chunk with runs is compacted to the first
+ * value of every run before it is hashed.
+ *
+ * Checking every pair of neighbours costs ~20% on input without runs, so only
+ * RUN_PROBES evenly spaced pairs are checked to decide whether to compact.
+ * With runs of length r a probe hits a repeat with probability (r-1)/r, so
+ * chunks of runs are practically never missed, and missing one only costs
+ * the speedup.
+ */
+#define RUN_PROBES 8
+
+void HashingCardinalityEstimator::increment_batch(const char * const *keys, const int *lengths, int n) {
+    const char *run_keys[HASH_BATCH_SIZE];
+    int run_lengths[HASH_BATCH_SIZE];
+    uint64_t hashes[HASH_BATCH_SIZE];
+    for (int start = 0; start < n; start += HASH_BATCH_SIZE) {
+        int batch = std::min(n - start, HASH_BATCH_SIZE);
+        const char * const *k = keys + start;
+        const int *l = lengths + start;
+        bool runs = false;
+        int step = batch / RUN_PROBES + 1;
+        for (int i = step; i < batch && !runs; i += step) {
+            runs = same_key(k[i], k[i - 1], l[i], l[i - 1]);
+        }
+        if (runs) {
+            run_keys[0] = k[0];
+            run_lengths[0] = l[0];
+            int n_runs = 1;
+            for (int i = 1; i < batch; i++) {
+                run_keys[n_runs] = k[i];
+                run_lengths[n_runs] = l[i];
+                n_runs += !same_key(k[i], k[i - 1], l[i], l[i - 1]);
+            }
+            k = run_keys;
+            l = run_lengths;
+            batch = n_runs;
+        }
+        this->hash_batch(k, l, batch, hashes);
+        this->add_hashes(hashes, batch);
+    }
+}
+
+void HashingCardinalityEstimator::increment_int_batch(const uint64_t *values, int n) {
+    uint64_t run_values[HASH_BATCH_SIZE];
+    uint64_t hashes[HASH_BATCH_SIZE];
+    for (int start = 0; start < n; start += HASH_BATCH_SIZE) {
+        int batch = std::min(n - start, HASH_BATCH_SIZE);
+        const uint64_t *v = values + start;
+        bool runs = false;
+        int step = batch / RUN_PROBES + 1;
+        for (int i = step; i < batch && !runs; i += step) {
+            runs = (v[i] == v[i - 1]);
+        }
+        if (runs) {
+            run_values[0] = v[0];
+            int n_runs = 1;
+            for (int i = 1; i < batch; i++) {
+                run_values[n_runs] = v[i];
+                n_runs += (v[i] != v[i - 1]);
+            }
+            v = run_values;
+            batch = n_runs;
+        }
+        this->hash_int_batch(v, batch, hashes);
+        this->add_hashes(hashes, batch);
+    }
+}
+
+void HashingCardinalityEstimator::increment_hash(uint64_t hash) {
+    this->add_hashes(&hash, 1);
+}
+
+void HashingCardinalityEstimator::increment_hash_batch(const uint64_t *hashes, int n) {
+    this->add_hashes(hashes, n);
 }
 
 /******* LinearProbabilisticCounter ********/
 
-LinearProbabilisticCounter::LinearProbabilisticCounter(int size): _bitset(size, false) {
+#define LPC_WORDS(size_in_bits) (((size_in_bits) + 63) / 64)
+
+LinearProbabilisticCounter::LinearProbabilisticCounter(int size, int hash_id):
+        HashingCardinalityEstimator(hash_id), _bitset(LPC_WORDS(size), 0) {
+    this->set_size(size);
+}
+
+/* size - 1 if size is a power of two, so bit indices need no division; 0 otherwise */
+static uint64_t lpc_size_mask(int size) {
+    bool power_of_two = size > 0 && (size & (size - 1)) == 0;
+    return power_of_two ? (uint64_t)size - 1 : 0;
+}
+
+static void lpc_set_bits(uint64_t *words, uint64_t size_in_bits, uint64_t size_mask, const uint64_t *hashes, int n) {
+    if (size_mask) {
+        for (int i = 0; i < n; i++) {
+            uint64_t bit = hashes[i] & size_mask;
+            words[bit / 64] |= (uint64_t)1 << (bit % 64);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        uint64_t bit = hashes[i] % size_in_bits;
+        words[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+void LinearProbabilisticCounter::set_size(int size) {
     this->size_in_bits = size;
+    this->size_mask = lpc_size_mask(size);
 }
 
 void LinearProbabilisticCounter::increment(const char *key, int len) {
@@ -97,26 +299,30 @@ void LinearProbabilisticCounter::increment(const char *key, int len) {
         len = strlen(key);
     }
     uint64_t h = this->hash(key, len);
-    uint64_t i = h % this->size_in_bits;
-    this->_bitset[i] = true;
+    uint64_t i = this->size_mask ? (h & this->size_mask) : (h % this->size_in_bits);
+    this->_bitset[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+void LinearProbabilisticCounter::add_hashes(const uint64_t *hashes, int n) {
+    lpc_set_bits(&this->_bitset[0], this->size_in_bits, this->size_mask, hashes, n);
 }
 
 int LinearProbabilisticCounter::count_set_bits() {
-    return (int)std::count(
-        this->_bitset.begin(),
-        this->_bitset.end(),
-        true
-    );
+    return words_popcount_u64(&this->_bitset[0], this->_bitset.size());
 }
 
-int LinearProbabilisticCounter::count() {
+static int linear_counting_estimate(int size_in_bits, int set_bits) {
     /* -size * ln(unset_bits/size) */
-    int unset_bits = this->size_in_bits - this->count_set_bits();
+    int unset_bits = size_in_bits - set_bits;
     if (unset_bits == 0) {
-        return this->size_in_bits;
+        return size_in_bits;
     }
-    double ratio = double(unset_bits) / double(this->size_in_bits);
-    return -this->size_in_bits * log(ratio);
+    double ratio = double(unset_bits) / double(size_in_bits);
+    return -size_in_bits * log(ratio);
+}
+
+int LinearProbabilisticCounter::count() {
+    return linear_counting_estimate(this->size_in_bits, this->count_set_bits());
 }
 
 std::string LinearProbabilisticCounter::repr() {
@@ -128,65 +334,206 @@ std::string LinearProbabilisticCounter::repr() {
 
 void LinearProbabilisticCounter::merge_from(ICardinalityEstimator *that) {
     LinearProbabilisticCounter *other = (LinearProbabilisticCounter *)that;
-    int i;
     if (this->size_in_bits != other->size_in_bits) {
         throw std::runtime_error("cannot merge LinearProbabilisticCounters with different parameters");
     }
-    for (i = 0; i < this->size_in_bits; i++) {
-        this->_bitset[i] = this->_bitset[i] || other->_bitset[i];
+    this->check_same_hash(other);
+    words_or_u64(&this->_bitset[0], &other->_bitset[0], this->_bitset.size());
+}
+
+void LinearProbabilisticCounter::merge_from(const LinearProbabilisticCounterView &other) {
+    if (this->size_in_bits != other.size_in_bits()) {
+        throw std::runtime_error("cannot merge LinearProbabilisticCounters with different parameters");
+    }
+    if (this->hasher->id != other.header->hash_id) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
     }
+    words_or_u64(&this->_bitset[0], other.words, this->_bitset.size());
 }
 
 ICardinalityEstimator* LinearProbabilisticCounter::clone() {
-    return new LinearProbabilisticCounter(this->size_in_bits);
+    return new LinearProbabilisticCounter(this->size_in_bits, this->hasher->id);
 }
 
 void LinearProbabilisticCounter::serialize(Serializer *serializer) {
-    serializer->write_int(this->size_in_bits);
-    uint64_t bit_buffer = 0;
-    int bb_i = 0;
-    int bit_i;
-    for (bit_i = 0; bit_i < this->size_in_bits; bit_i++) {
-        bit_buffer |= ((uint64_t)this->_bitset[bit_i] << bb_i);
-        bb_i++;
-        if (unlikely(bb_i >= 64)) {
-            serializer->write_uint64_t(bit_buffer);
-            bit_buffer = 0;
-            bb_i = 0;
-        }
-    }
-    if (bb_i > 0) {
-        serializer->write_uint64_t(bit_buffer);
+    SketchHeader header;
+    sketch_header_init(&header, SKETCH_KIND_LINEAR, this->size_in_bits, this->hasher->id, 0);
+    header.payload_length = sizeof(uint64_t) * this->_bitset.size();
+    header.crc32c = crc32c((const char *)&this->_bitset[0], header.payload_length);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span((const char *)&this->_bitset[0], header.payload_length);
+}
+
+/* Checks a linear counting header, wherever its payload is */
+static void lpc_check_header(const SketchHeader *header) {
+    sketch_check_header(header, SKETCH_KIND_LINEAR);
+    if ((int)header->param <= 0 || header->payload_length != sizeof(uint64_t) * LPC_WORDS(header->param)) {
+        throw std::runtime_error("LinearProbabilisticCounter sketch has invalid size");
     }
 }
 
 void LinearProbabilisticCounter::unserialize(Serializer *serializer) {
-    this->size_in_bits = serializer->read_int();
-    this->_bitset.resize(this->size_in_bits, false);
-    uint64_t bit_buffer = 0;
-    int bb_i = 64; // to force read on the first iteration
-    int bit_i = 0;
-    for (bit_i = 0; bit_i < this->size_in_bits; bit_i++) {
-        if (unlikely(bb_i >= 64)) {
-            bit_buffer = serializer->read_uint64_t();
-            bb_i = 0;
-        }
-        this->_bitset[bit_i] = !!(bit_buffer & ((uint64_t)1 << bb_i));
-        bb_i++;
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    lpc_check_header(&header);
+    this->set_size(header.param);
+    this->hasher = get_hash_function(header.hash_id);
+    this->_bitset.resize(LPC_WORDS(this->size_in_bits));
+    serializer->read_span((char *)&this->_bitset[0], header.payload_length);
+    sketch_check_payload(&header, (const char *)&this->_bitset[0]);
+}
+
+LinearProbabilisticCounterView::LinearProbabilisticCounterView(const char *data, size_t len) {
+    this->header = sketch_check(data, len, SKETCH_KIND_LINEAR);
+    lpc_check_header(this->header);
+    this->words = (const uint64_t *)sketch_payload(this->header);
+}
+
+int LinearProbabilisticCounterView::count() const {
+    int set_bits = words_popcount_u64(this->words, LPC_WORDS(this->size_in_bits()));
+    return linear_counting_estimate(this->size_in_bits(), set_bits);
+}
+
+/******* LinearProbabilisticOwnArrayCounter ********/
+
+size_t LinearProbabilisticOwnArrayCounter::storage_capacity(int size) {
+    return sizeof(SketchHeader) + sizeof(uint64_t) * LPC_WORDS(size);
+}
+
+void LinearProbabilisticOwnArrayCounter::init_storage(int size, char *storage, int hash_id) {
+    SketchHeader *header = (SketchHeader *)storage;
+    sketch_header_init(header, SKETCH_KIND_LINEAR, size, hash_id, 0);
+    header->payload_length = sizeof(uint64_t) * LPC_WORDS(size);
+    memset(sketch_payload(header), 0, header->payload_length);
+}
+
+LinearProbabilisticOwnArrayCounter::LinearProbabilisticOwnArrayCounter(int size, char *storage, int hash_id):
+        HashingCardinalityEstimator(hash_id) {
+    this->own_memory = false;
+    this->size_in_bits = size;
+    this->size_mask = lpc_size_mask(size);
+    if (!storage) {
+        storage = new char[storage_capacity(size)];
+        this->own_memory = true;
+        init_storage(size, storage, hash_id);
+    }
+    this->header = (SketchHeader *)storage;
+    this->words = (uint64_t *)sketch_payload(this->header);
+    if (this->header->kind != SKETCH_KIND_LINEAR || (int)this->header->param != size) {
+        throw std::runtime_error("LinearProbabilisticOwnArrayCounter storage was initialized with different parameters");
+    }
+    // an existing region keeps the hash it was built with
+    this->hasher = get_hash_function(this->header->hash_id);
+    // the region is about to change, a checksum it came with would go stale
+    this->header->flags &= ~SKETCH_FLAG_CRC32C;
+}
+
+LinearProbabilisticOwnArrayCounter::~LinearProbabilisticOwnArrayCounter() {
+    if (this->own_memory) {
+        delete[] (char *)this->header;
+    }
+}
+
+size_t LinearProbabilisticOwnArrayCounter::storage_used() {
+    return sketch_size(this->header);
+}
+
+void LinearProbabilisticOwnArrayCounter::increment(const char *key, int len) {
+    if (len == -1) {
+        len = strlen(key);
+    }
+    uint64_t h = this->hash(key, len);
+    this->add_hashes(&h, 1);
+}
+
+void LinearProbabilisticOwnArrayCounter::add_hashes(const uint64_t *hashes, int n) {
+    lpc_set_bits(this->words, this->size_in_bits, this->size_mask, hashes, n);
+}
+
+int LinearProbabilisticOwnArrayCounter::count() {
+    int set_bits = words_popcount_u64(this->words, LPC_WORDS(this->size_in_bits));
+    return linear_counting_estimate(this->size_in_bits, set_bits);
+}
+
+std::string LinearProbabilisticOwnArrayCounter::repr() {
+    char buf[100];
+    int memory = this->size_in_bits / 8;
+    sprintf(buf, "LinearProbabilisticOwnArrayCounter(n=%d, %s bytes)", this->size_in_bits,
+            human_readable_size(memory).c_str());
+    return std::string(buf);
+}
+
+void LinearProbabilisticOwnArrayCounter::merge_from(ICardinalityEstimator *that) {
+    LinearProbabilisticOwnArrayCounter *other = (LinearProbabilisticOwnArrayCounter *)that;
+    if (this->size_in_bits != other->size_in_bits) {
+        throw std::runtime_error("cannot merge LinearProbabilisticOwnArrayCounters with different parameters");
     }
+    this->check_same_hash(other);
+    words_or_u64(this->words, other->words, LPC_WORDS(this->size_in_bits));
+}
+
+void LinearProbabilisticOwnArrayCounter::merge_from(const LinearProbabilisticCounterView &other) {
+    if (this->size_in_bits != other.size_in_bits()) {
+        throw std::runtime_error("cannot merge LinearProbabilisticOwnArrayCounters with different parameters");
+    }
+    if (this->hasher->id != other.header->hash_id) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
+    }
+    words_or_u64(this->words, other.words, LPC_WORDS(this->size_in_bits));
+}
+
+ICardinalityEstimator* LinearProbabilisticOwnArrayCounter::clone() {
+    return new LinearProbabilisticOwnArrayCounter(this->size_in_bits, NULL, this->hasher->id);
+}
+
+/* The region already is a sketch; only the checksum has to be added on the way out */
+void LinearProbabilisticOwnArrayCounter::serialize(Serializer *serializer) {
+    SketchHeader header = *this->header;
+    header.crc32c = crc32c((const char *)this->words, header.payload_length);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span((const char *)this->words, header.payload_length);
+}
+
+void LinearProbabilisticOwnArrayCounter::unserialize(Serializer *serializer) {
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    lpc_check_header(&header);
+    if ((int)header.param != this->size_in_bits) {
+        /* storage region has a fixed size, we cannot resize memory we do not own */
+        throw std::runtime_error("cannot unserialize LinearProbabilisticOwnArrayCounter with different parameters");
+    }
+    serializer->read_span((char *)this->words, header.payload_length);
+    sketch_check_payload(&header, (const char *)this->words);
+    header.flags &= ~SKETCH_FLAG_CRC32C;
+    *this->header = header;
+    this->hasher = get_hash_function(header.hash_id);
 }
 
 /******* KMinValuesCounter ********/
 
-KMinValuesCounter::KMinValuesCounter(int k) : _minimal_values() {
+KMinValuesCounter::KMinValuesCounter(int k, int hash_id) : HashingCardinalityEstimator(hash_id), _values() {
     this->k = k;
+    this->n_sorted = 0;
+    this->threshold = UINT64_MAX;
+    this->_values.reserve(2 * (size_t)k);
 }
 
-int KMinValuesCounter::get_real_k() {
-    if ((int)this->_minimal_values.size() < this->k) {
-        return this->k;
+/* Folds pending hashes into the sorted prefix: sort, drop duplicates, keep the k smallest */
+void KMinValuesCounter::compact() {
+    if (this->n_sorted == this->_values.size()) {
+        return;
+    }
+    std::vector<uint64_t>::iterator middle = this->_values.begin() + this->n_sorted;
+    std::sort(middle, this->_values.end());
+    std::inplace_merge(this->_values.begin(), middle, this->_values.end());
+    this->_values.erase(std::unique(this->_values.begin(), this->_values.end()), this->_values.end());
+    if ((int)this->_values.size() > this->k) {
+        this->_values.resize(this->k);
     }
-    return this->_minimal_values.size();
+    this->n_sorted = this->_values.size();
+    this->threshold = ((int)this->n_sorted == this->k) ? this->_values.back() : UINT64_MAX;
 }
 
 void KMinValuesCounter::increment(const char *key, int len) {
@@ -194,25 +541,39 @@ void KMinValuesCounter::increment(const char *key, int len) {
         len = strlen(key);
     }
     uint64_t h = this->hash(key, len);
-    if (unlikely((int)this->_minimal_values.size() < this->k)) {
-        this->_minimal_values.push(h);
-    } else if (unlikely(h < this->_minimal_values.top())) {
-        if (likely((int)this->_minimal_values.size() == this->k)) {
-            this->_minimal_values.pop();
-        this->_minimal_values.push(h);
+    this->add_hashes(&h, 1);
+}
+
+void KMinValuesCounter::add_hashes(const uint64_t *hashes, int n) {
+    // pending hashes may take up to k slots past the sorted prefix before a compaction
+    const size_t limit = 2 * (size_t)this->k;
+    for (int i = 0; i < n; i++) {
+        uint64_t h = hashes[i];
+        if (likely(h >= this->threshold)) {
+            continue;
+        }
+        this->_values.push_back(h);
+        if (unlikely(this->_values.size() >= limit)) {
+            this->compact();
         }
     }
 }
 
-int KMinValuesCounter::count() {
+/* values: the smallest distinct hashes in ascending order, n <= k of them */
+static int kmv_estimate(int k, const uint64_t *values, size_t n) {
     /* (k - 1) / kth_min_normalized  */
     /* == (k - 1) / (kth_min / UINT64_MAX)  */
     /* == UINT64_MAX * (k - 1) / kth_min  */
-    int k = this->get_real_k();
-    if (k == 0) {
-        return 0;
+    if ((int)n < k) {
+        // fewer than k distinct hashes seen: they are all here
+        return n;
     }
-    return int(UINT64_MAX * double(k - 1) / double(this->_minimal_values.top()));
+    return int(UINT64_MAX * double(k - 1) / double(values[k - 1]));
+}
+
+int KMinValuesCounter::count() {
+    this->compact();
+    return kmv_estimate(this->k, this->_values.empty() ? NULL : &this->_values[0], this->_values.size());
 }
 
 std::string KMinValuesCounter::repr() {
@@ -222,120 +583,650 @@ std::string KMinValuesCounter::repr() {
     return std::string(buf);
 }
 
-/* Caution: this is a destructive merge, i.e. it empties "that" counter */
-void KMinValuesCounter::merge_from(ICardinalityEstimator *that) {
-    KMinValuesCounter *other = (KMinValuesCounter *)that;
-    uint64_t v;
-    while (!other->_minimal_values.empty()) {
-        v = other->_minimal_values.top();
-        other->_minimal_values.pop();
-        if (v < this->_minimal_values.top()) {
-            if ((int)this->_minimal_values.size() == this->k) {
-                this->_minimal_values.pop();
+/* Writes the at most k smallest values of the union of two ascending distinct lists to out,
+ * which must not overlap them; returns how many were written */
+static size_t kmv_union(const uint64_t *a, size_t n_a, const uint64_t *b, size_t n_b, int k, uint64_t *out) {
+    const uint64_t *a_end = a + n_a, *b_end = b + n_b;
+    size_t n = 0;
+    while ((int)n < k && (a != a_end || b != b_end)) {
+        uint64_t v;
+        if (b == b_end || (a != a_end && *a < *b)) {
+            v = *a++;
+        } else if (a == a_end || *b < *a) {
+            v = *b++;
+        } else {
+            v = *a++;
+            b++;
+        }
+        out[n++] = v;
+    }
+    return n;
+}
+
+/* Same as kmv_union, with the result replacing a, which must have room for k values.
+ * Counts the result first, then merges backwards from there: the write position never
+ * falls behind the next unread value of a, so no scratch buffer is needed */
+static size_t kmv_union_in_place(uint64_t *a, size_t n_a, const uint64_t *b, size_t n_b, int k) {
+    size_t i = 0, j = 0, n = 0;
+    while ((int)n < k && (i < n_a || j < n_b)) {
+        if (j == n_b || (i < n_a && a[i] < b[j])) {
+            i++;
+        } else if (i == n_a || b[j] < a[i]) {
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+        n++;
+    }
+    // a[0, i) and b[0, j) make up the result
+    size_t out = n;
+    while (j > 0) {
+        if (i > 0 && a[i - 1] > b[j - 1]) {
+            a[--out] = a[--i];
+        } else {
+            if (i > 0 && a[i - 1] == b[j - 1]) {
+                i--;
             }
-            this->_minimal_values.push(v);
+            a[--out] = b[--j];
         }
     }
+    return n;
+}
+
+/* Linear merge with the sorted prefix */
+void KMinValuesCounter::merge_sorted(const uint64_t *values, size_t n) {
+    this->compact();
+    std::vector<uint64_t> merged(this->k);
+    merged.resize(kmv_union(this->_values.data(), this->_values.size(), values, n, this->k, merged.data()));
+    merged.reserve(2 * (size_t)this->k);
+    this->_values.swap(merged);
+    this->n_sorted = this->_values.size();
+    this->threshold = ((int)this->n_sorted == this->k) ? this->_values.back() : UINT64_MAX;
+}
+
+/* "that" keeps its values */
+void KMinValuesCounter::merge_from(ICardinalityEstimator *that) {
+    KMinValuesCounter *other = (KMinValuesCounter *)that;
+    if (this->k != other->k) {
+        throw std::runtime_error("cannot merge KMinValuesCounters with different parameters");
+    }
+    this->check_same_hash(other);
+    other->compact();
+    this->merge_sorted(other->_values.empty() ? NULL : &other->_values[0], other->_values.size());
+}
+
+void KMinValuesCounter::merge_from(const KMinValuesView &other) {
+    if (this->k != other.k()) {
+        throw std::runtime_error("cannot merge KMinValuesCounters with different parameters");
+    }
+    if (this->hasher->id != other.header->hash_id) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
+    }
+    this->merge_sorted(other.values, other.n);
 }
 
 ICardinalityEstimator* KMinValuesCounter::clone() {
-    return new KMinValuesCounter(this->k);
+    return new KMinValuesCounter(this->k, this->hasher->id);
 }
 
 void KMinValuesCounter::serialize(Serializer *serializer) {
-    std::vector<uint64_t> backup_for_queue;
-    serializer->write_int(this->k);
-    serializer->write_int(this->_minimal_values.size());
+    this->compact();
+    SketchHeader header;
+    sketch_header_init(&header, SKETCH_KIND_KMV, this->k, this->hasher->id, KMV_ENCODING_VALUES);
+    header.payload_length = sizeof(uint64_t) * this->_values.size();
+    header.crc32c = crc32c((const char *)this->_values.data(), header.payload_length);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span((const char *)this->_values.data(), header.payload_length);
+}
 
-    while (!this->_minimal_values.empty()) {
-        uint64_t v = this->_minimal_values.top();
-        this->_minimal_values.pop();
-        backup_for_queue.push_back(v);
-        serializer->write_uint64_t(v);
+void KMinValuesCounter::unserialize(Serializer *serializer) {
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    sketch_check_header(&header, SKETCH_KIND_KMV);
+    size_t n = header.payload_length / sizeof(uint64_t);
+    if (header.encoding != KMV_ENCODING_VALUES) {
+        throw std::runtime_error("not a KMinValuesCounter sketch");
     }
+    if ((int)header.param <= 0 || n > header.param) {
+        throw std::runtime_error("KMinValuesCounter sketch has invalid size");
+    }
+    this->k = header.param;
+    this->hasher = get_hash_function(header.hash_id);
+    this->_values.clear();
+    this->_values.reserve(2 * (size_t)this->k);
+    this->_values.resize(n);
+    serializer->read_span((char *)this->_values.data(), sizeof(uint64_t) * n);
+    sketch_check_payload(&header, (const char *)this->_values.data());
+    // treat everything as pending, so values in any order are accepted
+    this->n_sorted = 0;
+    this->threshold = UINT64_MAX;
+    this->compact();
+}
 
-    while (!backup_for_queue.empty()) {
-        uint64_t v = backup_for_queue.back();
-        backup_for_queue.pop_back();
-        this->_minimal_values.push(v);
+KMinValuesView::KMinValuesView(const char *data, size_t len) {
+    this->header = sketch_check(data, len, SKETCH_KIND_KMV);
+    this->n = this->header->payload_length / sizeof(uint64_t);
+    if (this->header->encoding != KMV_ENCODING_VALUES) {
+        throw std::runtime_error("not a KMinValuesCounter sketch");
+    }
+    if ((int)this->header->param <= 0 || this->n > this->header->param) {
+        throw std::runtime_error("KMinValuesCounter sketch has invalid size");
+    }
+    this->values = (const uint64_t *)sketch_payload(this->header);
+    // merge_sorted() and kmv_estimate() rely on the order serialize() writes
+    for (size_t i = 1; i < this->n; i++) {
+        if (this->values[i - 1] >= this->values[i]) {
+            throw std::runtime_error("KMinValuesCounter sketch is not sorted");
+        }
     }
 }
 
-void KMinValuesCounter::unserialize(Serializer *serializer) {
-    this->k = serializer->read_int();
-    int n = serializer->read_int();
-    // strangely enough, priority_queue has no method clear()
-    while (!this->_minimal_values.empty()) {
-        this->_minimal_values.pop();
+int KMinValuesView::count() const {
+    return kmv_estimate(this->k(), this->values, this->n);
+}
+
+/******* KMinValuesOwnArrayCounter ********/
+
+size_t KMinValuesOwnArrayCounter::storage_capacity(int k) {
+    return sizeof(SketchHeader) + sizeof(uint64_t) * (size_t)k;
+}
+
+void KMinValuesOwnArrayCounter::init_storage(int k, char *storage, int hash_id) {
+    sketch_header_init((SketchHeader *)storage, SKETCH_KIND_KMV, k, hash_id, KMV_ENCODING_VALUES);
+}
+
+KMinValuesOwnArrayCounter::KMinValuesOwnArrayCounter(int k, char *storage, int hash_id):
+        HashingCardinalityEstimator(hash_id) {
+    this->own_memory = false;
+    this->k = k;
+    if (!storage) {
+        storage = new char[storage_capacity(k)];
+        this->own_memory = true;
+        init_storage(k, storage, hash_id);
+    }
+    this->header = (SketchHeader *)storage;
+    this->values = (uint64_t *)sketch_payload(this->header);
+    if (this->header->kind != SKETCH_KIND_KMV || this->header->encoding != KMV_ENCODING_VALUES ||
+            (int)this->header->param != k) {
+        throw std::runtime_error("KMinValuesOwnArrayCounter storage was initialized with different parameters");
+    }
+    // an existing region keeps the hash it was built with
+    this->hasher = get_hash_function(this->header->hash_id);
+    // the region is about to change, a checksum it came with would go stale
+    this->header->flags &= ~SKETCH_FLAG_CRC32C;
+    size_t n = this->n_values();
+    this->threshold = ((int)n == k) ? this->values[n - 1] : UINT64_MAX;
+}
+
+KMinValuesOwnArrayCounter::~KMinValuesOwnArrayCounter() {
+    if (this->own_memory) {
+        delete[] (char *)this->header;
+    } else {
+        // the region outlives the counter and must not lose hashes still waiting in memory
+        this->compact();
+    }
+}
+
+size_t KMinValuesOwnArrayCounter::n_values() {
+    return this->header->payload_length / sizeof(uint64_t);
+}
+
+/* Folds pending hashes into the region; does not allocate, as the destructor relies on */
+void KMinValuesOwnArrayCounter::compact() {
+    if (this->pending.empty()) {
+        return;
+    }
+    std::sort(this->pending.begin(), this->pending.end());
+    this->pending.erase(std::unique(this->pending.begin(), this->pending.end()), this->pending.end());
+    this->merge_region(this->pending.data(), this->pending.size());
+    this->pending.clear();
+}
+
+void KMinValuesOwnArrayCounter::merge_region(const uint64_t *values, size_t n) {
+    size_t n_merged = kmv_union_in_place(this->values, this->n_values(), values, n, this->k);
+    this->header->payload_length = sizeof(uint64_t) * n_merged;
+    this->threshold = ((int)n_merged == this->k) ? this->values[n_merged - 1] : UINT64_MAX;
+}
+
+void KMinValuesOwnArrayCounter::merge_sorted(const uint64_t *values, size_t n) {
+    this->compact();
+    this->merge_region(values, n);
+}
+
+size_t KMinValuesOwnArrayCounter::storage_used() {
+    this->compact();
+    return sketch_size(this->header);
+}
+
+void KMinValuesOwnArrayCounter::increment(const char *key, int len) {
+    if (len == -1) {
+        len = strlen(key);
     }
+    uint64_t h = this->hash(key, len);
+    this->add_hashes(&h, 1);
+}
+
+void KMinValuesOwnArrayCounter::add_hashes(const uint64_t *hashes, int n) {
     for (int i = 0; i < n; i++) {
-        uint64_t v = serializer->read_uint64_t();
-        //printf("restoring %lu\n", v);
-        this->_minimal_values.push(v);
+        uint64_t h = hashes[i];
+        if (likely(h >= this->threshold)) {
+            continue;
+        }
+        this->pending.push_back(h);
+        if (unlikely((int)this->pending.size() >= this->k)) {
+            this->compact();
+        }
     }
 }
 
+int KMinValuesOwnArrayCounter::count() {
+    this->compact();
+    return kmv_estimate(this->k, this->values, this->n_values());
+}
+
+std::string KMinValuesOwnArrayCounter::repr() {
+    char buf[60];
+    int memory = sizeof(uint64_t) * this->k;
+    sprintf(buf, "KMinValuesOwnArrayCounter(k=%d, %s bytes)", this->k, human_readable_size(memory).c_str());
+    return std::string(buf);
+}
+
+/* "that" keeps its values */
+void KMinValuesOwnArrayCounter::merge_from(ICardinalityEstimator *that) {
+    KMinValuesOwnArrayCounter *other = (KMinValuesOwnArrayCounter *)that;
+    if (this->k != other->k) {
+        throw std::runtime_error("cannot merge KMinValuesOwnArrayCounters with different parameters");
+    }
+    this->check_same_hash(other);
+    other->compact();
+    this->merge_sorted(other->values, other->n_values());
+}
+
+void KMinValuesOwnArrayCounter::merge_from(const KMinValuesView &other) {
+    if (this->k != other.k()) {
+        throw std::runtime_error("cannot merge KMinValuesOwnArrayCounters with different parameters");
+    }
+    if (this->hasher->id != other.header->hash_id) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
+    }
+    this->merge_sorted(other.values, other.n);
+}
+
+ICardinalityEstimator* KMinValuesOwnArrayCounter::clone() {
+    return new KMinValuesOwnArrayCounter(this->k, NULL, this->hasher->id);
+}
+
+void KMinValuesOwnArrayCounter::serialize(Serializer *serializer) {
+    this->compact();
+    SketchHeader header = *this->header;
+    header.crc32c = crc32c((const char *)this->values, header.payload_length);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span((const char *)this->values, header.payload_length);
+}
+
+void KMinValuesOwnArrayCounter::unserialize(Serializer *serializer) {
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    sketch_check_header(&header, SKETCH_KIND_KMV);
+    size_t n = header.payload_length / sizeof(uint64_t);
+    if (header.encoding != KMV_ENCODING_VALUES) {
+        throw std::runtime_error("not a KMinValuesCounter sketch");
+    }
+    if ((int)header.param != this->k || n > header.param) {
+        /* storage region has a fixed size, we cannot resize memory we do not own */
+        throw std::runtime_error("cannot unserialize KMinValuesOwnArrayCounter with different parameters");
+    }
+    std::vector<uint64_t> values(n);
+    serializer->read_span((char *)values.data(), sizeof(uint64_t) * n);
+    sketch_check_payload(&header, (const char *)values.data());
+    this->hasher = get_hash_function(header.hash_id);
+    init_storage(this->k, (char *)this->header, header.hash_id);
+    this->pending.clear();
+    this->threshold = UINT64_MAX;
+    // treat everything as pending, so values in any order are accepted
+    this->pending.swap(values);
+    this->compact();
+}
+
+/******* KMinValuesOverlap ********/
+
+KMinValuesOverlap::KMinValuesOverlap(int k) {
+    this->k = k;
+    this->hash_id = 0;
+    this->n_sketches = 0;
+}
+
+/* Combines with the state of other sketches; common NULL means all values are common */
+void KMinValuesOverlap::merge(int k, int hash_id, int n_sketches, const uint64_t *values, const uint8_t *common, size_t n) {
+    if (n_sketches == 0) {
+        return;
+    }
+    if (this->n_sketches > 0 && this->hash_id != hash_id) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
+    }
+    this->k = std::min(this->k, k);
+    // a value below both thresholds that is missing from one side is held by none of its
+    // sketches; with no sketches on this side yet, the other side alone decides
+    bool a_empty = this->n_sketches == 0;
+    std::vector<uint64_t> merged;
+    std::vector<uint8_t> merged_common;
+    merged.reserve(this->k);
+    merged_common.reserve(this->k);
+    size_t a = 0, b = 0, a_end = this->values.size();
+    while ((int)merged.size() < this->k && (a < a_end || b < n)) {
+        if (b == n || (a < a_end && this->values[a] < values[b])) {
+            merged.push_back(this->values[a]);
+            merged_common.push_back(0);
+            a++;
+        } else if (a == a_end || values[b] < this->values[a]) {
+            merged.push_back(values[b]);
+            merged_common.push_back((!common || common[b]) && a_empty);
+            b++;
+        } else {
+            merged.push_back(values[b]);
+            merged_common.push_back(this->common[a] && (!common || common[b]));
+            a++;
+            b++;
+        }
+    }
+    this->values.swap(merged);
+    this->common.swap(merged_common);
+    this->hash_id = hash_id;
+    this->n_sketches += n_sketches;
+}
+
+void KMinValuesOverlap::add(const KMinValuesView &sketch) {
+    this->merge(sketch.k(), sketch.header->hash_id, 1, sketch.values, NULL, sketch.n);
+}
+
+void KMinValuesOverlap::merge_from(const KMinValuesOverlap &other) {
+    this->merge(other.k, other.hash_id, other.n_sketches,
+                other.values.data(), other.common.data(), other.values.size());
+}
+
+int KMinValuesOverlap::union_count() const {
+    return kmv_estimate(this->k, this->values.data(), this->values.size());
+}
+
+double KMinValuesOverlap::jaccard() const {
+    if (this->values.empty()) {
+        return 0;
+    }
+    size_t n_common = std::count(this->common.begin(), this->common.end(), 1);
+    return double(n_common) / this->values.size();
+}
+
+int KMinValuesOverlap::intersection_count() const {
+    if ((int)this->values.size() < this->k) {
+        // the union is known exactly, and so is the intersection
+        return std::count(this->common.begin(), this->common.end(), 1);
+    }
+    return int(this->jaccard() * this->union_count() + 0.5);
+}
+
+size_t KMinValuesOverlap::serialized_size(int k) {
+    return sizeof(SketchHeader) + (sizeof(uint64_t) + 1) * (size_t)k;
+}
+
+void KMinValuesOverlap::serialize(Serializer *serializer) {
+    size_t n = this->values.size();
+    SketchHeader header;
+    sketch_header_init(&header, SKETCH_KIND_KMV, this->k, this->n_sketches ? this->hash_id : HASH_DEFAULT,
+                       KMV_ENCODING_OVERLAP);
+    header.aux = this->n_sketches;
+    header.payload_length = (sizeof(uint64_t) + 1) * n;
+    header.crc32c = crc32c((const char *)this->values.data(), sizeof(uint64_t) * n);
+    header.crc32c = crc32c((const char *)this->common.data(), n, header.crc32c);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span((const char *)this->values.data(), sizeof(uint64_t) * n);
+    serializer->write_span((const char *)this->common.data(), n);
+}
+
+void KMinValuesOverlap::unserialize(Serializer *serializer) {
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    sketch_check_header(&header, SKETCH_KIND_KMV);
+    size_t n = header.payload_length / (sizeof(uint64_t) + 1);
+    if (header.encoding != KMV_ENCODING_OVERLAP || (int)header.param <= 0 || n > header.param ||
+            header.payload_length != (sizeof(uint64_t) + 1) * n) {
+        throw std::runtime_error("KMinValuesOverlap state is invalid");
+    }
+    this->values.resize(n);
+    this->common.resize(n);
+    serializer->read_span((char *)this->values.data(), sizeof(uint64_t) * n);
+    serializer->read_span((char *)this->common.data(), n);
+    uint32_t crc = crc32c((const char *)this->values.data(), sizeof(uint64_t) * n);
+    if (crc32c((const char *)this->common.data(), n, crc) != header.crc32c) {
+        throw std::runtime_error("sketch checksum mismatch");
+    }
+    for (size_t i = 1; i < n; i++) {
+        if (this->values[i - 1] >= this->values[i]) {
+            throw std::runtime_error("KMinValuesOverlap state is not sorted");
+        }
+    }
+    this->k = header.param;
+    this->hash_id = header.hash_id;
+    this->n_sketches = header.aux;
+}
+
 /******* HyperLogLogCounter ********/
 
 #define HYPER_LOG_LOG_B_MAX 20
 
-HyperLogLogCounter::HyperLogLogCounter(int b): buckets(
+#define HLL_SPARSE_INDEX(entry) ((int)((entry) >> 8))
+#define HLL_SPARSE_VALUE(entry) ((uint8_t)((entry) & 0xff))
+#define HLL_SPARSE_ENTRY(j, value) (((uint32_t)(j) << 8) | (uint32_t)(value))
+
+static size_t hll_packed_length(int m, int width) {
+    return 2 + (size_t)(m / 8) * width;
+}
+
+/* Writes the packed encoding of m dense registers to out, returns its length */
+static size_t hll_pack_registers(const uint8_t *regs, int m, uint8_t *out) {
+    uint8_t lo = regs[0], hi = regs[0];
+    for (int i = 1; i < m; i++) {
+        lo = (regs[i] < lo) ? regs[i] : lo;
+        hi = (regs[i] > hi) ? regs[i] : hi;
+    }
+    int width = 0;
+    while ((hi - lo) >> width) {
+        width++;
+    }
+    out[0] = lo;
+    out[1] = width;
+    uint8_t *group_out = out + 2;
+    for (int i = 0; i < m; i += 8) {
+        uint64_t group = 0;
+        for (int k = 0; k < 8; k++) {
+            group |= (uint64_t)(regs[i + k] - lo) << (k * width);
+        }
+        memcpy(group_out, &group, width);
+        group_out += width;
+    }
+    return hll_packed_length(m, width);
+}
+
+static void hll_unpack_registers(const uint8_t *packed, int m, uint8_t *regs) {
+    uint8_t lo = packed[0];
+    int width = packed[1];
+    const uint64_t mask = ((uint64_t)1 << width) - 1;
+    const uint8_t *group_in = packed + 2;
+    for (int i = 0; i < m; i += 8) {
+        uint64_t group = 0;
+        memcpy(&group, group_in, width);
+        group_in += width;
+        for (int k = 0; k < 8; k++) {
+            regs[i + k] = lo + ((group >> (k * width)) & mask);
+        }
+    }
+}
+
+/* Register updates for precisions whose registers outgrow the L2 cache.
+ *
+ * Random hashes hit a random register each, so past a few hundred KB of
+ * registers nearly every update is a cache miss. Registers for hashes a few
+ * positions ahead are prefetched, and counters that can buffer hashes
+ * radix-partition them by the top bits of the register index, so that each
+ * slice of registers is updated while it is in cache.
+ */
+#define HLL_PARTITION_MIN_B 16
+/* 2^14 registers per slice: 64 KB of int registers */
+#define HLL_SLICE_BITS 14
+#define HLL_PREFETCH_DISTANCE 16
+
+template<class Register>
+static void hll_update_prefetch(Register *buckets, int b, const uint64_t *hashes, size_t n) {
+    const uint64_t m_mask = ((uint64_t)1 << b) - 1;
+    for (size_t i = 0; i < n; i++) {
+        if (i + HLL_PREFETCH_DISTANCE < n) {
+            __builtin_prefetch(&buckets[hashes[i + HLL_PREFETCH_DISTANCE] & m_mask], 1);
+        }
+        uint64_t h = hashes[i];
+        int j = h & m_mask;
+        Register rank = hll_rank(h >> b);
+        buckets[j] = (rank > buckets[j]) ? rank : buckets[j];
+    }
+}
+
+/* scratch: room for n hashes */
+template<class Register>
+static void hll_update_partitioned(Register *buckets, int b, const uint64_t *hashes, size_t n, uint64_t *scratch) {
+    const int n_slices = 1 << (b - HLL_SLICE_BITS);
+    const uint64_t m_mask = ((uint64_t)1 << b) - 1;
+    size_t offsets[(1 << (HYPER_LOG_LOG_B_MAX - HLL_SLICE_BITS)) + 1] = {0};
+    for (size_t i = 0; i < n; i++) {
+        offsets[((hashes[i] & m_mask) >> HLL_SLICE_BITS) + 1]++;
+    }
+    for (int s = 0; s < n_slices; s++) {
+        offsets[s + 1] += offsets[s];
+    }
+    size_t next[1 << (HYPER_LOG_LOG_B_MAX - HLL_SLICE_BITS)];
+    memcpy(next, offsets, n_slices * sizeof(size_t));
+    for (size_t i = 0; i < n; i++) {
+        scratch[next[(hashes[i] & m_mask) >> HLL_SLICE_BITS]++] = hashes[i];
+    }
+    for (int s = 0; s < n_slices; s++) {
+        hll_update_prefetch(buckets, b, scratch + offsets[s], offsets[s + 1] - offsets[s]);
+    }
+}
+
+/* Precision-specific parts of the HyperLogLog counters.
+ *
+ * Instantiated for every supported b and register type, so the register count
+ * and index mask are compile-time constants in the update loop. A counter picks
+ * the instance matching its runtime b from hll_kernels_u8[] or hll_kernels_i32[].
+ *
+ * Merges and counts are not specialised further: merges are bound by memory and
+ * already run in the runtime-dispatched AVX2 kernels, which a known trip count
+ * does not beat (an unrolled loop was slower from b = 8 on), and the cost of a
+ * count at small b is hll_estimate()'s fixed work, not the register histogram.
+ */
+static inline void hll_registers_histogram(const uint8_t *regs, size_t n, uint32_t *hist) {
+    registers_histogram_u8(regs, n, hist);
+}
+
+static inline void hll_registers_histogram(const int *regs, size_t n, uint32_t *hist) {
+    registers_histogram_i32(regs, n, hist);
+}
+
+template<int B, class Register>
+struct HyperLogLogCore {
+    static const int m = 1 << B;
+    static const uint64_t m_mask = m - 1;
+
+    static void increment_dense(Register *buckets, const uint64_t *hashes, int n) {
+        if (B >= HLL_PARTITION_MIN_B) {
+            // batches cannot be buffered for partitioning here, but can be prefetched
+            hll_update_prefetch(buckets, B, hashes, n);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t h = hashes[i];
+            int j = h & m_mask;
+            Register rank = (Register)hll_rank(h >> B);
+            buckets[j] = (rank > buckets[j]) ? rank : buckets[j];
+        }
+    }
+
+    static int count_dense(const Register *buckets) {
+        uint32_t hist[256];
+        hll_registers_histogram(buckets, m, hist);
+        return hll_estimate(hist, B);
+    }
+};
+
+template<class Register>
+struct HyperLogLogKernels {
+    void (*increment_dense)(Register *buckets, const uint64_t *hashes, int n);
+    int (*count_dense)(const Register *buckets);
+};
+
+#define HLL_KERNELS(B, Register) { \
+    HyperLogLogCore<B, Register>::increment_dense, \
+    HyperLogLogCore<B, Register>::count_dense }
+
+#define HLL_KERNEL_TABLE(Register) { \
+    HLL_KERNELS(4, Register), HLL_KERNELS(5, Register), HLL_KERNELS(6, Register), HLL_KERNELS(7, Register), \
+    HLL_KERNELS(8, Register), HLL_KERNELS(9, Register), HLL_KERNELS(10, Register), HLL_KERNELS(11, Register), \
+    HLL_KERNELS(12, Register), HLL_KERNELS(13, Register), HLL_KERNELS(14, Register), HLL_KERNELS(15, Register), \
+    HLL_KERNELS(16, Register), HLL_KERNELS(17, Register), HLL_KERNELS(18, Register), HLL_KERNELS(19, Register), \
+    HLL_KERNELS(20, Register) }
+
+/* indexed by b - 4 */
+static const HyperLogLogKernels<uint8_t> hll_kernels_u8[] = HLL_KERNEL_TABLE(uint8_t);
+static const HyperLogLogKernels<int> hll_kernels_i32[] = HLL_KERNEL_TABLE(int);
+
+HyperLogLogCounter::HyperLogLogCounter(int b, int hash_id): HashingCardinalityEstimator(hash_id), buckets(
         int(pow(2, constrain_int(b, 4, HYPER_LOG_LOG_B_MAX))), 0) {
-    this->b = b;
-    this->m = int(pow(2, constrain_int(b, 4, HYPER_LOG_LOG_B_MAX)));
+    this->b = constrain_int(b, 4, HYPER_LOG_LOG_B_MAX);
+    this->m = int(pow(2, this->b));
     this->m_mask = this->m - 1; // 'b' ones
+    this->kernels = &hll_kernels_i32[this->b - 4];
 }
 
-double HyperLogLogCounter::get_alpha() {
-    switch (this->b) {
-        case 4: return 0.673;
-        case 5: return 0.697;
-        case 6: return 0.709;
+/* Applies buffered hashes */
+void HyperLogLogCounter::flush() {
+    if (this->pending.empty()) {
+        return;
     }
-    return 0.7213 / (1.0 + 1.079 / double(1 << this->b));
+    this->scratch.resize(this->pending.size());
+    hll_update_partitioned(&this->buckets[0], this->b, &this->pending[0], this->pending.size(), &this->scratch[0]);
+    this->pending.clear();
 }
 
 void HyperLogLogCounter::increment(const char *key, int len) {
     if (len == -1) {
         len = strlen(key);
     }
-    uint64_t h = this->hash(key, len);
-    int j = h & this->m_mask;
-    uint64_t w = h >> this->b;
-    int run_of_ones = count_run_of_ones(w);
-    this->buckets[j] = (run_of_ones > this->buckets[j]) ? run_of_ones : this->buckets[j];
+    this->increment_hash(this->hash(key, len));
 }
 
-int HyperLogLogCounter::count() {
-    /* DV_est = alpha * m^2 * 1/sum( 2^ -register ) */
-    double estimate = this->get_alpha() * this->m * this->m;
-    double sum = 0.0;
-    int i;
-    for (i = 0; i < this->m; i++) {
-        sum += pow(2, -this->buckets[i]);
-    }
-    estimate = estimate * 1.0 / sum;
-
-    if (estimate < 2.5 * this->m) {
-        // small range correction
-        int v = this->number_of_zero_buckets();
-        if (v > 0) {
-            estimate = this->m * log(this->m / double(v));
+void HyperLogLogCounter::increment_hash(uint64_t h) {
+    if (this->b >= HLL_PARTITION_MIN_B) {
+        this->pending.push_back(h);
+        if (this->pending.size() >= HLL_PENDING_MAX) {
+            this->flush();
         }
-    } else if (estimate > 1/30.0 * pow(2, 64)) {
-        // large range correction (for hash collisions)
-        // And we use a 64-bit hash...
-        estimate = -pow(2, 64) * log(1.0 - estimate / pow(2, 64));
+        return;
     }
-    return estimate;
+    int j = h & this->m_mask;
+    uint64_t w = h >> this->b;
+    int rank = hll_rank(w);
+    this->buckets[j] = (rank > this->buckets[j]) ? rank : this->buckets[j];
 }
 
-int HyperLogLogCounter::number_of_zero_buckets() {
-    return (int)std::count(
-        this->buckets.begin(),
-        this->buckets.end(),
-        0
-    );
+/* For b >= HLL_PARTITION_MIN_B the kernel prefetches: a batch already has hashes to prefetch ahead for */
+void HyperLogLogCounter::add_hashes(const uint64_t *hashes, int n) {
+    this->kernels->increment_dense(&this->buckets[0], hashes, n);
+}
+
+int HyperLogLogCounter::count() {
+    this->flush();
+    return this->kernels->count_dense(&this->buckets[0]);
 }
 
 std::string HyperLogLogCounter::repr() {
@@ -350,74 +1241,404 @@ void HyperLogLogCounter::merge_from(ICardinalityEstimator *that) {
     if (this->m != other->m) {
         throw std::runtime_error("cannot merge HyperLogLogCounters with different parameters");
     }
-    int i;
-    for (i = 0; i < this->m; i++) {
-        int my_v = this->buckets[i];
-        int his_v = other->buckets[i];
-        this->buckets[i] = (my_v > his_v) ? my_v : his_v;
-    }
+    this->check_same_hash(other);
+    this->flush();
+    other->flush();
+    registers_max_i32(&this->buckets[0], &other->buckets[0], this->m);
 }
 
 ICardinalityEstimator* HyperLogLogCounter::clone() {
-    return new HyperLogLogCounter(this->b);
+    return new HyperLogLogCounter(this->b, this->hasher->id);
 }
 
+/* Written as a dense HyperLogLogOwnArrayCounter sketch, so either class can read it */
 void HyperLogLogCounter::serialize(Serializer *serializer) {
-    serializer->write_int(this->b);
-    serializer->write_int(this->m);
-    serializer->write_int(this->m_mask);
-    for (int i = 0; i < this->m; i++) {
-        serializer->write_int(this->buckets[i]);
-    }
+    this->flush();
+    std::vector<uint8_t> registers(this->buckets.begin(), this->buckets.end());
+    SketchHeader header;
+    sketch_header_init(&header, SKETCH_KIND_HYPERLOGLOG, this->b, this->hasher->id, HLL_ENCODING_DENSE);
+    header.payload_length = this->m;
+    header.crc32c = crc32c((const char *)&registers[0], this->m);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span((const char *)&registers[0], this->m);
 }
 
 void HyperLogLogCounter::unserialize(Serializer *serializer) {
-    this->b = serializer->read_int();
-    this->m = serializer->read_int();
-    this->m_mask = serializer->read_int();
-    this->buckets.resize(this->m);
-    for (int i = 0; i < this->m; i++) {
-        int v = serializer->read_int();
-        this->buckets[i] = v;
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    sketch_check_header(&header, SKETCH_KIND_HYPERLOGLOG);
+    if (header.param < 4 || header.param > HYPER_LOG_LOG_B_MAX) {
+        throw std::runtime_error("HyperLogLog sketch has invalid precision");
+    }
+    // registers are widened to ints below, so a contiguous payload need not be copied first
+    const char *payload = serializer->borrow(header.payload_length);
+    std::vector<char> copy;
+    if (!payload) {
+        copy.resize(header.payload_length);
+        serializer->read_span(&copy[0], header.payload_length);
+        payload = &copy[0];
+    }
+    sketch_check_payload(&header, payload);
+
+    // hashes buffered for the old registers are dropped with them
+    this->pending.clear();
+    this->b = header.param;
+    this->m = 1 << this->b;
+    this->m_mask = this->m - 1;
+    this->kernels = &hll_kernels_i32[this->b - 4];
+    this->hasher = get_hash_function(header.hash_id);
+    this->buckets.assign(this->m, 0);
+    if (header.encoding == HLL_ENCODING_DENSE && header.payload_length == (uint32_t)this->m) {
+        for (int i = 0; i < this->m; i++) {
+            this->buckets[i] = (uint8_t)payload[i];
+        }
+    } else if (header.encoding == HLL_ENCODING_PACKED && header.payload_length >= 2 && payload[1] <= 8 &&
+            header.payload_length == hll_packed_length(this->m, payload[1])) {
+        std::vector<uint8_t> registers(this->m);
+        hll_unpack_registers((const uint8_t *)payload, this->m, &registers[0]);
+        for (int i = 0; i < this->m; i++) {
+            this->buckets[i] = registers[i];
+        }
+    } else if (header.encoding == HLL_ENCODING_EXACT && header.payload_length % sizeof(uint64_t) == 0) {
+        for (uint32_t i = 0; i < header.payload_length / sizeof(uint64_t); i++) {
+            uint64_t h;
+            memcpy(&h, &payload[sizeof(uint64_t) * i], sizeof(h));
+            if (h != 0) {
+                int j = h & this->m_mask;
+                int rank = hll_rank(h >> this->b);
+                this->buckets[j] = (rank > this->buckets[j]) ? rank : this->buckets[j];
+            }
+        }
+    } else if (header.encoding == HLL_ENCODING_SPARSE && header.payload_length % sizeof(uint32_t) == 0) {
+        uint32_t n = header.payload_length / sizeof(uint32_t);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t entry;
+            memcpy(&entry, &payload[sizeof(uint32_t) * i], sizeof(entry));
+            if (HLL_SPARSE_INDEX(entry) >= this->m) {
+                throw std::runtime_error("HyperLogLog sketch has invalid sparse entry");
+            }
+            this->buckets[HLL_SPARSE_INDEX(entry)] = HLL_SPARSE_VALUE(entry);
+        }
+    } else {
+        throw std::runtime_error("HyperLogLog sketch has invalid encoding");
     }
 }
 
 /******* HyperLogLogOwnArrayCounter ********/
 
-HyperLogLogOwnArrayCounter::HyperLogLogOwnArrayCounter(int b, char *storage0, char *storage1) {
+size_t HyperLogLogOwnArrayCounter::storage_capacity(int b) {
+    return sizeof(SketchHeader) + ((size_t)1 << constrain_int(b, 4, HYPER_LOG_LOG_B_MAX));
+}
+
+/* Smallest exact table; tinier regions start with registers right away */
+#define HLL_EXACT_MIN_SLOTS 16
+
+void HyperLogLogOwnArrayCounter::init_storage(int b, char *storage, int hash_id) {
+    b = constrain_int(b, 4, HYPER_LOG_LOG_B_MAX);
+    bool exact = ((size_t)1 << b) >= HLL_EXACT_MIN_SLOTS * sizeof(uint64_t);
+    sketch_header_init((SketchHeader *)storage, SKETCH_KIND_HYPERLOGLOG, b, hash_id,
+                       exact ? HLL_ENCODING_EXACT : HLL_ENCODING_SPARSE);
+}
+
+static void hll_check_packed(const SketchHeader *header, const uint8_t *payload) {
+    int width = payload[1];
+    if (width > 8 || header->payload_length != hll_packed_length(1 << header->param, width)) {
+        throw std::runtime_error("HyperLogLog sketch has invalid size");
+    }
+}
+
+/* Checks the parts of a HyperLogLog header that do not depend on where the payload is */
+static void hll_check_header(const SketchHeader *header) {
+    sketch_check_header(header, SKETCH_KIND_HYPERLOGLOG);
+    if (header->param < 4 || header->param > HYPER_LOG_LOG_B_MAX) {
+        throw std::runtime_error("HyperLogLog sketch has invalid precision");
+    }
+    size_t m = (size_t)1 << header->param;
+    if (header->encoding == HLL_ENCODING_SPARSE) {
+        if (header->payload_length % sizeof(uint32_t) != 0 || header->payload_length / sizeof(uint32_t) > m / 16) {
+            throw std::runtime_error("HyperLogLog sketch has too many sparse entries");
+        }
+    } else if (header->encoding == HLL_ENCODING_DENSE) {
+        if (header->payload_length != m) {
+            throw std::runtime_error("HyperLogLog sketch has invalid size");
+        }
+    } else if (header->encoding == HLL_ENCODING_EXACT) {
+        size_t slots = header->payload_length / sizeof(uint64_t);
+        if (header->payload_length % sizeof(uint64_t) != 0 || (slots & (slots - 1)) != 0 ||
+                header->payload_length > m || 4 * (size_t)header->aux > 3 * slots) {
+            throw std::runtime_error("HyperLogLog sketch has invalid exact table");
+        }
+    } else if (header->encoding == HLL_ENCODING_PACKED) {
+        // the width byte is checked with the payload, see hll_check_packed()
+        if (header->payload_length < 2 || header->payload_length >= m) {
+            throw std::runtime_error("HyperLogLog sketch has invalid size");
+        }
+    } else {
+        throw std::runtime_error("HyperLogLog sketch has unknown encoding");
+    }
+}
+
+void HyperLogLogOwnArrayCounter::check_storage(const char *storage, size_t len) {
+    const SketchHeader *header = sketch_check(storage, len, SKETCH_KIND_HYPERLOGLOG);
+    hll_check_header(header);
+    if (header->encoding == HLL_ENCODING_PACKED) {
+        hll_check_packed(header, (const uint8_t *)sketch_payload(header));
+    }
+    if (header->encoding == HLL_ENCODING_EXACT) {
+        // count() trusts aux
+        const uint64_t *table = (const uint64_t *)sketch_payload(header);
+        uint32_t used = 0;
+        for (size_t i = 0; i < header->payload_length / sizeof(uint64_t); i++) {
+            used += (table[i] != 0);
+        }
+        if (used != header->aux) {
+            throw std::runtime_error("HyperLogLog sketch has invalid exact table");
+        }
+    }
+    if (header->encoding == HLL_ENCODING_SPARSE) {
+        // merging indexes the dense registers with these, and relies on their order
+        const uint32_t *entries = (const uint32_t *)sketch_payload(header);
+        uint32_t n = header->payload_length / sizeof(uint32_t);
+        int m = 1 << header->param;
+        for (uint32_t i = 0; i < n; i++) {
+            if (HLL_SPARSE_INDEX(entries[i]) >= m ||
+                    (i > 0 && HLL_SPARSE_INDEX(entries[i - 1]) >= HLL_SPARSE_INDEX(entries[i]))) {
+                throw std::runtime_error("HyperLogLog sketch has invalid sparse entries");
+            }
+        }
+    }
+}
+
+/* Estimate of a checked sketch, shared by the counter and HyperLogLogView */
+static int hll_count(const SketchHeader *header) {
+    const HyperLogLogKernels<uint8_t> *kernels = &hll_kernels_u8[header->param - 4];
+    if (header->encoding == HLL_ENCODING_DENSE) {
+        return kernels->count_dense((const uint8_t *)sketch_payload(header));
+    }
+    if (header->encoding == HLL_ENCODING_EXACT) {
+        return header->aux;
+    }
+    if (header->encoding == HLL_ENCODING_PACKED) {
+        std::vector<uint8_t> registers((size_t)1 << header->param);
+        hll_unpack_registers((const uint8_t *)sketch_payload(header), registers.size(), &registers[0]);
+        return kernels->count_dense(&registers[0]);
+    }
+    // registers missing from the sparse list are zeros;
+    // sparse entries are created by increments, which never store a zero
+    const uint32_t *sparse = (const uint32_t *)sketch_payload(header);
+    int n = header->payload_length / sizeof(uint32_t);
+    uint32_t hist[256] = {0};
+    hist[0] = (1 << header->param) - n;
+    for (int i = 0; i < n; i++) {
+        hist[HLL_SPARSE_VALUE(sparse[i])]++;
+    }
+    return hll_estimate(hist, header->param);
+}
+
+HyperLogLogOwnArrayCounter::HyperLogLogOwnArrayCounter(int b, char *storage, int hash_id):
+        HashingCardinalityEstimator(hash_id) {
     this->own_buckets_memory = false;
-    this->b = b;
-    this->m = int(pow(2, constrain_int(b, 4, HYPER_LOG_LOG_B_MAX)));
+    this->b = constrain_int(b, 4, HYPER_LOG_LOG_B_MAX);
+    this->m = 1 << this->b;
     this->m_mask = this->m - 1; // 'b' ones
+    this->kernels = &hll_kernels_u8[this->b - 4];
+    /* sparse entries take 4 bytes each; past m/4 bytes the dense array is cheaper to work with */
+    this->sparse_max = this->m / 16;
 
-    if (storage0 && storage1) {
-        this->buckets[0] = (uint32_t *)storage0;
-        this->buckets[1] = (uint32_t *)storage1;
-    } else {
-        this->buckets[0] = new uint32_t[this->m/2];
-        this->buckets[1] = new uint32_t[this->m/2];
+    if (!storage) {
+        storage = new char[storage_capacity(this->b)];
         this->own_buckets_memory = true;
-        for (int i = 0; i < this->m/2; i++) {
-            this->buckets[0][i] = 0;
-            this->buckets[1][i] = 0;
-        }
+        init_storage(this->b, storage, hash_id);
+    }
+    this->header = (SketchHeader *)storage;
+    this->buckets = (uint8_t *)sketch_payload(this->header);
+    this->sparse = (uint32_t *)this->buckets;
+    if ((int)this->header->param != this->b) {
+        throw std::runtime_error("HyperLogLogOwnArrayCounter storage was initialized with different parameters");
+    }
+    // an existing region keeps the hash it was built with
+    this->hasher = get_hash_function(this->header->hash_id);
+    // the region is about to change, a checksum it came with would go stale
+    this->header->flags &= ~SKETCH_FLAG_CRC32C;
+    if (this->header->encoding == HLL_ENCODING_PACKED) {
+        this->unpack();
     }
 }
 
 HyperLogLogOwnArrayCounter::~HyperLogLogOwnArrayCounter() {
     if (this->own_buckets_memory) {
-        delete this->buckets[0];
-        delete this->buckets[1];
+        delete[] (char *)this->header;
+    }
+}
+
+size_t HyperLogLogOwnArrayCounter::storage_used() {
+    return sketch_size(this->header);
+}
+
+bool HyperLogLogOwnArrayCounter::is_sparse() {
+    return this->header->encoding == HLL_ENCODING_SPARSE;
+}
+
+uint32_t HyperLogLogOwnArrayCounter::n_sparse() {
+    return this->header->payload_length / sizeof(uint32_t);
+}
+
+void HyperLogLogOwnArrayCounter::set_n_sparse(uint32_t n) {
+    this->header->payload_length = sizeof(uint32_t) * n;
+}
+
+/* Sets register j to max(register j, value) in the sparse list, keeping it sorted */
+void HyperLogLogOwnArrayCounter::sparse_update(int j, uint8_t value) {
+    uint32_t n = this->n_sparse();
+    uint32_t *entries = this->sparse;
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (HLL_SPARSE_INDEX(entries[mid]) < j) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < n && HLL_SPARSE_INDEX(entries[lo]) == j) {
+        if (value > HLL_SPARSE_VALUE(entries[lo])) {
+            entries[lo] = HLL_SPARSE_ENTRY(j, value);
+        }
+        return;
+    }
+    if (unlikely((int)n >= this->sparse_max)) {
+        this->convert_to_dense();
+        this->update_register(j, value);
+        return;
+    }
+    memmove(entries + lo + 1, entries + lo, sizeof(uint32_t) * (n - lo));
+    entries[lo] = HLL_SPARSE_ENTRY(j, value);
+    this->set_n_sparse(n + 1);
+}
+
+void HyperLogLogOwnArrayCounter::update_register(int j, uint8_t value) {
+    if (unlikely(this->header->encoding != HLL_ENCODING_DENSE)) {
+        if (this->header->encoding == HLL_ENCODING_EXACT) {
+            this->convert_exact();
+        }
+        if (this->is_sparse()) {
+            this->sparse_update(j, value);
+            return;
+        }
+        if (this->header->encoding == HLL_ENCODING_PACKED) {
+            this->unpack();
+        }
+    }
+    uint8_t old_value = this->buckets[j];
+    this->buckets[j] = (value > old_value) ? value : old_value;
+}
+
+/* Rewrites the sparse list as a dense register array in the same storage region */
+void HyperLogLogOwnArrayCounter::convert_to_dense() {
+    std::vector<uint32_t> entries(this->sparse, this->sparse + this->n_sparse());
+    memset(this->buckets, 0, this->m);
+    for (size_t i = 0; i < entries.size(); i++) {
+        this->buckets[HLL_SPARSE_INDEX(entries[i])] = HLL_SPARSE_VALUE(entries[i]);
+    }
+    this->header->encoding = HLL_ENCODING_DENSE;
+    this->header->payload_length = this->m;
+}
+
+void HyperLogLogOwnArrayCounter::pack() {
+    if (this->header->encoding != HLL_ENCODING_DENSE) {
+        return;
+    }
+    std::vector<uint8_t> packed(hll_packed_length(this->m, 8));
+    size_t len = hll_pack_registers(this->buckets, this->m, &packed[0]);
+    if (len >= (size_t)this->m) {
+        // registers spread over all 8 bits cannot be packed
+        return;
+    }
+    memcpy(this->buckets, &packed[0], len);
+    this->header->payload_length = len;
+    this->header->encoding = HLL_ENCODING_PACKED;
+}
+
+void HyperLogLogOwnArrayCounter::unpack() {
+    std::vector<uint8_t> packed(this->buckets, this->buckets + this->header->payload_length);
+    hll_unpack_registers(&packed[0], this->m, this->buckets);
+    this->header->encoding = HLL_ENCODING_DENSE;
+    this->header->payload_length = this->m;
+}
+
+/* Inserts a hash into the exact table, growing it or switching to registers when it gets too full */
+void HyperLogLogOwnArrayCounter::exact_add(uint64_t h) {
+    if (unlikely(h == 0)) {
+        h = 1; // 0 marks empty slots; merging two hashes out of 2^64 does not matter
+    }
+    if (unlikely(this->header->payload_length == 0)) {
+        // a new region has no table yet; the smallest one always fits into the registers
+        this->exact_grow();
+    }
+    uint64_t *table = (uint64_t *)this->buckets;
+    uint32_t mask = this->header->payload_length / sizeof(uint64_t) - 1;
+    uint32_t i = h & mask;
+    while (table[i] != 0) {
+        if (table[i] == h) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    if (unlikely(4 * (this->header->aux + 1) > 3 * (mask + 1))) {
+        if (!this->exact_grow()) {
+            this->convert_exact();
+            this->add_hash(h);
+            return;
+        }
+        this->exact_add(h);
+        return;
+    }
+    table[i] = h;
+    this->header->aux++;
+}
+
+/* Doubles the exact table in place; false if it would not fit into the register array */
+bool HyperLogLogOwnArrayCounter::exact_grow() {
+    size_t slots = this->header->payload_length / sizeof(uint64_t);
+    size_t new_slots = slots ? 2 * slots : HLL_EXACT_MIN_SLOTS;
+    if (new_slots * sizeof(uint64_t) > (size_t)this->m) {
+        return false;
+    }
+    uint64_t *table = (uint64_t *)this->buckets;
+    std::vector<uint64_t> hashes(table, table + slots);
+    memset(table, 0, new_slots * sizeof(uint64_t));
+    this->header->payload_length = new_slots * sizeof(uint64_t);
+    this->header->aux = 0;
+    for (size_t i = 0; i < slots; i++) {
+        if (hashes[i] != 0) {
+            this->exact_add(hashes[i]);
+        }
+    }
+    return true;
+}
+
+/* Replaces the exact table with the registers its hashes would have produced */
+void HyperLogLogOwnArrayCounter::convert_exact() {
+    uint64_t *table = (uint64_t *)this->buckets;
+    std::vector<uint64_t> hashes(table, table + this->header->payload_length / sizeof(uint64_t));
+    this->header->encoding = HLL_ENCODING_SPARSE;
+    this->header->payload_length = 0;
+    this->header->aux = 0;
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (hashes[i] != 0) {
+            this->add_hash(hashes[i]);
+        }
     }
 }
 
-double HyperLogLogOwnArrayCounter::get_alpha() {
-    switch (this->b) {
-        case 4: return 0.673;
-        case 5: return 0.697;
-        case 6: return 0.709;
+void HyperLogLogOwnArrayCounter::add_hash(uint64_t h) {
+    if (unlikely(this->header->encoding == HLL_ENCODING_EXACT)) {
+        this->exact_add(h);
+        return;
     }
-    return 0.7213 / (1.0 + 1.079 / double(1 << this->b));
+    /* run length is at most 64 - b + 1, so it always fits into a byte register */
+    this->update_register(h & this->m_mask, (uint8_t)hll_rank(h >> this->b));
 }
 
 /* TODO: move to HLL base class */
@@ -425,59 +1646,175 @@ void HyperLogLogOwnArrayCounter::increment(const char *key, int len) {
     if (len == -1) {
         len = strlen(key);
     }
-    uint64_t h = this->hash(key, len);
-    int j = h & this->m_mask;
-    int j_bucket = j & 1;
-    j = j >> 1;
-    uint64_t w = h >> this->b;
-    uint32_t run_of_ones = (uint32_t)count_run_of_ones(w);
-    uint32_t old_value = this->buckets[j_bucket][j];
-    this->buckets[j_bucket][j] = (run_of_ones > old_value) ? run_of_ones : old_value;
+    this->add_hash(this->hash(key, len));
+}
+
+void HyperLogLogOwnArrayCounter::add_hashes(const uint64_t *hashes, int n) {
+    int i = 0;
+    // the exact set may turn into registers, and the sparse list dense, in the middle of a batch
+    for (; i < n && this->header->encoding == HLL_ENCODING_EXACT; i++) {
+        this->exact_add(hashes[i]);
+    }
+    for (; i < n && this->is_sparse(); i++) {
+        uint64_t h = hashes[i];
+        this->sparse_update(h & this->m_mask, (uint8_t)hll_rank(h >> this->b));
+    }
+    if (unlikely(i < n && this->header->encoding == HLL_ENCODING_PACKED)) {
+        this->unpack();
+    }
+    this->kernels->increment_dense(this->buckets, hashes + i, n - i);
 }
 
 int HyperLogLogOwnArrayCounter::count() {
-    /* DV_est = alpha * m^2 * 1/sum( 2^ -register ) */
-    double estimate = this->get_alpha() * this->m * this->m;
-    double sum = 0.0;
-    int i;
-    for (i = 0; i < this->m/2; i++) {
-        sum += pow(2, -(double)this->buckets[0][i]);
-        sum += pow(2, -(double)this->buckets[1][i]);
+    return hll_count(this->header);
+}
+
+static const char *hll_encoding_name(int encoding) {
+    switch (encoding) {
+        case HLL_ENCODING_SPARSE: return "sparse";
+        case HLL_ENCODING_DENSE: return "dense";
+        case HLL_ENCODING_PACKED: return "packed";
+        case HLL_ENCODING_EXACT: return "exact";
+    }
+    return "unknown";
+}
+
+std::string HyperLogLogOwnArrayCounter::repr() {
+    char buf[100];
+    int memory = this->storage_used();
+    sprintf(buf, "HyperLogLogOwnArrayCounter(b=%d, m=%d, %s, %s bytes)", this->b, this->m,
+            hll_encoding_name(this->header->encoding),
+            human_readable_size(memory).c_str());
+    return std::string(buf);
+}
+
+/* Merges our sorted sparse list with another one, falling back to dense registers if the union is too long */
+void HyperLogLogOwnArrayCounter::sparse_merge(const uint32_t *other, uint32_t n2) {
+    uint32_t n1 = this->n_sparse();
+    std::vector<uint32_t> merged;
+    merged.reserve(n1 + n2);
+    uint32_t i = 0, j = 0;
+    while (i < n1 && j < n2) {
+        uint32_t a = this->sparse[i];
+        uint32_t b = other[j];
+        if (HLL_SPARSE_INDEX(a) < HLL_SPARSE_INDEX(b)) {
+            merged.push_back(a);
+            i++;
+        } else if (HLL_SPARSE_INDEX(a) > HLL_SPARSE_INDEX(b)) {
+            merged.push_back(b);
+            j++;
+        } else {
+            merged.push_back((a > b) ? a : b);
+            i++;
+            j++;
+        }
     }
-    estimate = estimate * 1.0 / sum;
+    merged.insert(merged.end(), this->sparse + i, this->sparse + n1);
+    merged.insert(merged.end(), other + j, other + n2);
 
-    if (estimate < 2.5 * this->m) {
-        // small range correction
-        int v = this->number_of_zero_buckets();
-        if (v > 0) {
-            estimate = this->m * log(this->m / double(v));
+    if ((int)merged.size() > this->sparse_max) {
+        memset(this->buckets, 0, this->m);
+        for (i = 0; i < merged.size(); i++) {
+            this->buckets[HLL_SPARSE_INDEX(merged[i])] = HLL_SPARSE_VALUE(merged[i]);
         }
-    } else if (estimate > 1/30.0 * pow(2, 64)) {
-        // large range correction (for hash collisions)
-        // And we use a 64-bit hash...
-        estimate = -pow(2, 64) * log(1.0 - estimate / pow(2, 64));
+        this->header->encoding = HLL_ENCODING_DENSE;
+        this->header->payload_length = this->m;
+        return;
     }
-    return estimate;
+    if (!merged.empty()) {
+        memcpy(this->sparse, &merged[0], sizeof(uint32_t) * merged.size());
+    }
+    this->set_n_sparse(merged.size());
 }
 
-int HyperLogLogOwnArrayCounter::number_of_zero_buckets() {
-    int i, count = 0;
-    for (i = 0; i < this->m/2; i++) {
-        if (this->buckets[0][i] == 0) {
-            count++;
+void HyperLogLogOwnArrayCounter::merge_region(const SketchHeader *other) {
+    const char *payload = sketch_payload(other);
+    if (other->encoding == HLL_ENCODING_EXACT) {
+        const uint64_t *table = (const uint64_t *)payload;
+        for (size_t i = 0; i < other->payload_length / sizeof(uint64_t); i++) {
+            if (table[i] != 0) {
+                this->add_hash(table[i]);
+            }
+        }
+        return;
+    }
+    if (this->header->encoding == HLL_ENCODING_EXACT) {
+        this->convert_exact();
+    }
+    if (other->encoding == HLL_ENCODING_SPARSE) {
+        const uint32_t *entries = (const uint32_t *)payload;
+        uint32_t n = other->payload_length / sizeof(uint32_t);
+        if (this->is_sparse()) {
+            this->sparse_merge(entries, n);
+            return;
         }
-        if (this->buckets[1][i] == 0) {
-            count++;
+        for (uint32_t i = 0; i < n; i++) {
+            this->update_register(HLL_SPARSE_INDEX(entries[i]), HLL_SPARSE_VALUE(entries[i]));
         }
+        return;
     }
-    return count;
+    if (this->is_sparse()) {
+        this->convert_to_dense();
+    } else if (this->header->encoding == HLL_ENCODING_PACKED) {
+        this->unpack();
+    }
+    if (other->encoding == HLL_ENCODING_PACKED) {
+        std::vector<uint8_t> registers(this->m);
+        hll_unpack_registers((const uint8_t *)payload, this->m, &registers[0]);
+        registers_max_u8(this->buckets, &registers[0], this->m);
+        return;
+    }
+    registers_max_u8(this->buckets, (const uint8_t *)payload, this->m);
 }
 
-std::string HyperLogLogOwnArrayCounter::repr() {
-    char buf[100];
-    int memory = sizeof(this->buckets[0][0]) * this->m;
-    sprintf(buf, "HyperLogLogOwnArrayCounter(b=%d, m=%d, %s bytes)", this->b, this->m, human_readable_size(memory).c_str());
-    return std::string(buf);
+/* Register j = J mod m of a precision b sketch sees the hashes of registers J of a higher
+ * precision sketch; its rank counts the index bits above b, then the higher rank if all of them are ones */
+static inline uint8_t hll_fold_rank(uint32_t J, uint8_t value, int b, int other_b) {
+    uint32_t high = J >> b;
+    uint32_t ones = ((uint32_t)1 << (other_b - b)) - 1;
+    return (high == ones) ? (uint8_t)(other_b - b + value) : (uint8_t)hll_rank(high);
+}
+
+void HyperLogLogOwnArrayCounter::fold_region(const SketchHeader *other) {
+    const char *payload = sketch_payload(other);
+    int other_b = other->param;
+    if (other->encoding == HLL_ENCODING_EXACT) {
+        // hashes do not depend on the precision
+        this->merge_region(other);
+        return;
+    }
+    if (other->encoding == HLL_ENCODING_SPARSE) {
+        const uint32_t *entries = (const uint32_t *)payload;
+        uint32_t n = other->payload_length / sizeof(uint32_t);
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t J = HLL_SPARSE_INDEX(entries[i]);
+            this->update_register(J & this->m_mask, hll_fold_rank(J, HLL_SPARSE_VALUE(entries[i]), this->b, other_b));
+        }
+        return;
+    }
+    std::vector<uint8_t> registers((size_t)1 << other_b);
+    const uint8_t *other_registers = (const uint8_t *)payload;
+    if (other->encoding == HLL_ENCODING_PACKED) {
+        hll_unpack_registers(other_registers, registers.size(), &registers[0]);
+        other_registers = &registers[0];
+    }
+    std::vector<uint8_t> folded(this->m);
+    for (uint32_t J = 0; J < registers.size(); J++) {
+        if (other_registers[J] != 0) {
+            uint8_t rank = hll_fold_rank(J, other_registers[J], this->b, other_b);
+            uint8_t &r = folded[J & this->m_mask];
+            r = (rank > r) ? rank : r;
+        }
+    }
+    if (this->header->encoding == HLL_ENCODING_EXACT) {
+        this->convert_exact();
+    }
+    if (this->is_sparse()) {
+        this->convert_to_dense();
+    } else if (this->header->encoding == HLL_ENCODING_PACKED) {
+        this->unpack();
+    }
+    registers_max_u8(this->buckets, &folded[0], this->m);
 }
 
 void HyperLogLogOwnArrayCounter::merge_from(ICardinalityEstimator *that) {
@@ -485,48 +1822,70 @@ void HyperLogLogOwnArrayCounter::merge_from(ICardinalityEstimator *that) {
     if (this->m != other->m) {
         throw std::runtime_error("cannot merge HyperLogLogOwnArrayCounter with different parameters");
     }
-    int i;
-    for (i = 0; i < this->m/2; i++) {
-        uint32_t my_v = this->buckets[0][i];
-        uint32_t his_v = other->buckets[0][i];
-        this->buckets[0][i] = (my_v > his_v) ? my_v : his_v;
+    this->check_same_hash(other);
+    this->merge_region(other->header);
+}
 
-        my_v = this->buckets[1][i];
-        his_v = other->buckets[1][i];
-        this->buckets[1][i] = (my_v > his_v) ? my_v : his_v;
+void HyperLogLogOwnArrayCounter::merge_from(const HyperLogLogView &other) {
+    if (this->b > other.b()) {
+        throw std::runtime_error("cannot merge a HyperLogLog sketch of lower precision");
+    }
+    if (this->hasher->id != other.header->hash_id) {
+        throw std::runtime_error("cannot merge sketches built with different hash functions");
     }
+    if (this->b < other.b()) {
+        this->fold_region(other.header);
+        return;
+    }
+    this->merge_region(other.header);
 }
 
 ICardinalityEstimator* HyperLogLogOwnArrayCounter::clone() {
-    return new HyperLogLogOwnArrayCounter(this->b, NULL, NULL);
+    return new HyperLogLogOwnArrayCounter(this->b, NULL, this->hasher->id);
 }
 
+/* The region already is a sketch; only the checksum has to be added on the way out */
 void HyperLogLogOwnArrayCounter::serialize(Serializer *serializer) {
-    serializer->write_int(this->b);
-    serializer->write_int(this->m);
-    serializer->write_int(this->m_mask);
-    for (int i = 0; i < this->m/2; i++) {
-        serializer->write_uint32_t(this->buckets[0][i]);
-        serializer->write_uint32_t(this->buckets[1][i]);
-    }
+    SketchHeader header = *this->header;
+    header.crc32c = crc32c(sketch_payload(this->header), header.payload_length);
+    header.flags |= SKETCH_FLAG_CRC32C;
+    serializer->write_span((const char *)&header, sizeof(header));
+    serializer->write_span(sketch_payload(this->header), header.payload_length);
 }
 
 void HyperLogLogOwnArrayCounter::unserialize(Serializer *serializer) {
-    this->b = serializer->read_int();
-    this->m = serializer->read_int();
-    this->m_mask = serializer->read_int();
-    //this->buckets.resize(this->m);
-    for (int i = 0; i < this->m/2; i++) {
-        uint32_t v = serializer->read_uint32_t();
-        this->buckets[0][i] = v;
-        v = serializer->read_uint32_t();
-        this->buckets[1][i] = v;
+    SketchHeader header;
+    serializer->read_span((char *)&header, sizeof(header));
+    hll_check_header(&header);
+    if ((int)header.param != this->b) {
+        /* storage region has a fixed size, we cannot resize memory we do not own */
+        throw std::runtime_error("cannot unserialize HyperLogLogOwnArrayCounter with different parameters");
+    }
+    serializer->read_span((char *)this->buckets, header.payload_length);
+    sketch_check_payload(&header, (const char *)this->buckets);
+    if (header.encoding == HLL_ENCODING_PACKED) {
+        hll_check_packed(&header, this->buckets);
     }
+    header.flags &= ~SKETCH_FLAG_CRC32C;
+    *this->header = header;
+    this->hasher = get_hash_function(header.hash_id);
+    if (header.encoding == HLL_ENCODING_PACKED) {
+        this->unpack();
+    }
+}
+
+HyperLogLogView::HyperLogLogView(const char *data, size_t len) {
+    HyperLogLogOwnArrayCounter::check_storage(data, len);
+    this->header = (const SketchHeader *)data;
+}
+
+int HyperLogLogView::count() const {
+    return hll_count(this->header);
 }
 
 /******* DummyCounter ********/
 
-DummyCounter::DummyCounter(int ignored) {
+DummyCounter::DummyCounter(int ignored): HashingCardinalityEstimator(HASH_DEFAULT) {
     this->c = 0;
 }
 
@@ -534,6 +1893,10 @@ void DummyCounter::increment(const char *key, int len) {
     this->c++;
 }
 
+void DummyCounter::add_hashes(const uint64_t *hashes, int n) {
+    this->c += n;
+}
+
 int DummyCounter::count() {
     return this->c;
 }
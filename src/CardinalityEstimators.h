@@ -3,14 +3,24 @@
 
 #include <vector>
 #include <string>
-#include <queue>
 #include <stdint.h>
 #include "Serializer.h"
+#include "HashFunctions.h"
+#include "SketchFormat.h"
 
 class ICardinalityEstimator {
     public:
         virtual ~ICardinalityEstimator() {}
         virtual void increment(const char *key, int len=-1) = 0;
+        /* Same as calling increment(keys[i], lengths[i]) for i in 0..n-1, but without a virtual call per key */
+        virtual void increment_batch(const char * const *keys, const int *lengths, int n) = 0;
+        /* Same as increment_batch(), for fixed-width values (integers, dates, bit patterns of floats) */
+        virtual void increment_int_batch(const uint64_t *values, int n) = 0;
+        /* Adds values that are 64-bit hashes already, bypassing the hash function. The sketch
+         * still records its hash family, so use one of the HASH_PREHASHED families to keep such
+         * sketches from being merged with ones hashed differently */
+        virtual void increment_hash(uint64_t hash) = 0;
+        virtual void increment_hash_batch(const uint64_t *hashes, int n) = 0;
         virtual int count() = 0;
         virtual std::string repr() = 0;
         virtual void merge_from(ICardinalityEstimator *other) = 0;
@@ -22,10 +32,72 @@ class ICardinalityEstimator {
 
 class HashingCardinalityEstimator: public ICardinalityEstimator {
     protected:
+        const HashFunction *hasher;
+        HashMemo *memo;
+        HashingCardinalityEstimator(int hash_id);
+        /* throws if other was built with a different hash family */
+        void check_same_hash(HashingCardinalityEstimator *other);
         uint64_t hash(const char *key);
         uint64_t hash(const char *key, int len);
+        void hash_batch(const char * const *keys, const int *lengths, int n, uint64_t *hashes);
+        void hash_int_batch(const uint64_t *values, int n, uint64_t *hashes);
+        /* Updates the sketch with n hashes computed by hash_batch() or hash_int_batch() */
+        virtual void add_hashes(const uint64_t *hashes, int n) = 0;
+    public:
+        /* one of the HASH_* ids from HashFunctions.h */
+        int hash_function_id();
+        /* Looks up increment_batch() keys in memo before hashing them; NULL turns it off.
+         * The memo is not owned, must outlive its use and must use the same hash family */
+        void set_hash_memo(HashMemo *memo);
+        /* Runs of equal consecutive values (sorted or RLE columns) are hashed and applied once */
+        virtual void increment_batch(const char * const *keys, const int *lengths, int n);
+        virtual void increment_int_batch(const uint64_t *values, int n);
+        virtual void increment_hash(uint64_t hash);
+        virtual void increment_hash_batch(const uint64_t *hashes, int n);
+};
+
+/* Number of hashes computed at once by increment_batch() implementations */
+#define HASH_BATCH_SIZE 256
+
+
+/*
+ * Read-only views of stored sketches.
+ *
+ * A view checks a buffer holding one complete sketch in the SketchFormat.h
+ * layout (as written by serialize() into a single container, or a
+ * HyperLogLogOwnArrayCounter storage region) and reads it in place, without
+ * copying it into an estimator. Constructors throw std::runtime_error for
+ * anything that is not an intact sketch of the right kind. The buffer must
+ * outlive the view.
+ */
+
+class LinearProbabilisticCounterView {
+    public:
+        const SketchHeader *header;
+        const uint64_t *words;
+        LinearProbabilisticCounterView(const char *data, size_t len);
+        int size_in_bits() const { return this->header->param; }
+        int count() const;
+};
+
+class KMinValuesView {
+    public:
+        const SketchHeader *header;
+        /* ascending distinct hashes, at most k of them */
+        const uint64_t *values;
+        size_t n;
+        KMinValuesView(const char *data, size_t len);
+        int k() const { return this->header->param; }
+        int count() const;
 };
 
+class HyperLogLogView {
+    public:
+        const SketchHeader *header;
+        HyperLogLogView(const char *data, size_t len);
+        int b() const { return this->header->param; }
+        int count() const;
+};
 
 /*
  * Linear probabilistic counter.
@@ -35,16 +107,60 @@ class HashingCardinalityEstimator: public ICardinalityEstimator {
  */
 class LinearProbabilisticCounter: public HashingCardinalityEstimator {
     protected:
-        std::vector<bool> _bitset;
+        /* bit i lives in word i / 64, at bit position i % 64 */
+        std::vector<uint64_t> _bitset;
         int size_in_bits;
+        /* size_in_bits - 1 if it is a power of two, so bit indices need no division; 0 otherwise */
+        uint64_t size_mask;
+        void set_size(int size);
         int count_set_bits();
+        virtual void add_hashes(const uint64_t *hashes, int n);
     public:
-        /* size: number of bits in bitset. Should be on the order of couple millions. The more, the greater counting precision you get */
-        LinearProbabilisticCounter(int size);
+        /* size: number of bits in bitset. Should be on the order of couple millions. The more, the greater counting precision you get.
+         * Powers of two are slightly faster to update */
+        LinearProbabilisticCounter(int size, int hash_id=HASH_DEFAULT);
         virtual void increment(const char *key, int len=-1);
         virtual int count();
         virtual std::string repr();
         virtual void merge_from(ICardinalityEstimator *other);
+        void merge_from(const LinearProbabilisticCounterView &other);
+        virtual ICardinalityEstimator* clone();
+        virtual void serialize(Serializer *serializer);
+        virtual void unserialize(Serializer *serializer);
+};
+
+/* Linear probabilistic counter working on an externally provided storage region
+ *
+ * The region is a linear counting sketch in the SketchFormat.h layout, the
+ * header followed by the whole bitset, and is updated in place. It has its
+ * full size from the start, so init_storage() clears all of it.
+ */
+class LinearProbabilisticOwnArrayCounter: public HashingCardinalityEstimator {
+    protected:
+        SketchHeader *header;
+        uint64_t *words;
+        bool own_memory;
+        int size_in_bits;
+        /* see LinearProbabilisticCounter */
+        uint64_t size_mask;
+        virtual void add_hashes(const uint64_t *hashes, int n);
+    public:
+        /* size: number of bits in bitset
+         * storage: region of storage_capacity(size) bytes prepared with init_storage(), or NULL to allocate it internally
+         * hash_id: hash family for an internally allocated region; a provided region keeps the one it was initialized with */
+        LinearProbabilisticOwnArrayCounter(int size, char *storage, int hash_id=HASH_DEFAULT);
+        virtual ~LinearProbabilisticOwnArrayCounter();
+        static size_t storage_capacity(int size);
+        /* writes an empty sketch into all storage_capacity(size) bytes of storage */
+        static void init_storage(int size, char *storage, int hash_id=HASH_DEFAULT);
+        /* bytes of the storage region in use, always storage_capacity(); the region is a sketch in the
+         * SketchFormat.h layout, without a checksum */
+        size_t storage_used();
+        virtual void increment(const char *key, int len=-1);
+        virtual int count();
+        virtual std::string repr();
+        virtual void merge_from(ICardinalityEstimator *other);
+        void merge_from(const LinearProbabilisticCounterView &other);
         virtual ICardinalityEstimator* clone();
         virtual void serialize(Serializer *serializer);
         virtual void unserialize(Serializer *serializer);
@@ -56,38 +172,155 @@ class LinearProbabilisticCounter: public HashingCardinalityEstimator {
  */
 class KMinValuesCounter: public HashingCardinalityEstimator {
     protected:
-        std::priority_queue<uint64_t> _minimal_values;
-        int get_real_k();
+        /* _values[0, n_sorted) are the smallest distinct hashes in ascending order, at most k of them;
+         * the rest are pending hashes not yet folded in by compact() */
+        std::vector<uint64_t> _values;
+        size_t n_sorted;
+        /* k-th smallest hash once k are known; hashes at or above it cannot change the sketch */
+        uint64_t threshold;
         int k;
+        void compact();
+        /* unions the sketch with n ascending distinct hashes */
+        void merge_sorted(const uint64_t *values, size_t n);
+        virtual void add_hashes(const uint64_t *hashes, int n);
     public:
         /* k: number of minimal values to store. On the order of couple thousand. The more, the greater counting precision you get */
-        KMinValuesCounter(int k);
+        KMinValuesCounter(int k, int hash_id=HASH_DEFAULT);
         virtual void increment(const char *key, int len=-1);
         virtual int count();
         virtual std::string repr();
         virtual void merge_from(ICardinalityEstimator *other);
+        void merge_from(const KMinValuesView &other);
         virtual ICardinalityEstimator* clone();
         virtual void serialize(Serializer *serializer);
         virtual void unserialize(Serializer *serializer);
 };
 
+/* K Minimal Values estimator working on an externally provided storage region
+ *
+ * The region is a KMV sketch in the SketchFormat.h layout: the header, then at
+ * most k ascending hashes. Hashes below the current k-th smallest are collected
+ * in memory and folded into the region by compact(), which count(),
+ * storage_used(), merges, serialize() and the destructor call. The region's
+ * length can change with every compaction, so read it from storage_used() or
+ * the header once the counter is gone.
+ */
+class KMinValuesOwnArrayCounter: public HashingCardinalityEstimator {
+    protected:
+        SketchHeader *header;
+        /* the region's ascending hashes, header->payload_length / 8 of them */
+        uint64_t *values;
+        bool own_memory;
+        int k;
+        std::vector<uint64_t> pending;
+        /* see KMinValuesCounter */
+        uint64_t threshold;
+        size_t n_values();
+        void compact();
+        /* unions the region alone, without pending hashes, with n ascending distinct hashes */
+        void merge_region(const uint64_t *values, size_t n);
+        /* unions the sketch with n ascending distinct hashes */
+        void merge_sorted(const uint64_t *values, size_t n);
+        virtual void add_hashes(const uint64_t *hashes, int n);
+    public:
+        /* k: number of minimal values to store
+         * storage: region of storage_capacity(k) bytes prepared with init_storage(), or NULL to allocate it internally
+         * hash_id: hash family for an internally allocated region; a provided region keeps the one it was initialized with */
+        KMinValuesOwnArrayCounter(int k, char *storage, int hash_id=HASH_DEFAULT);
+        virtual ~KMinValuesOwnArrayCounter();
+        static size_t storage_capacity(int k);
+        /* writes an empty sketch into storage; only the header bytes are touched */
+        static void init_storage(int k, char *storage, int hash_id=HASH_DEFAULT);
+        /* bytes of the storage region in use, after folding in pending hashes; the region is a sketch
+         * in the SketchFormat.h layout, without a checksum */
+        size_t storage_used();
+        virtual void increment(const char *key, int len=-1);
+        virtual int count();
+        virtual std::string repr();
+        virtual void merge_from(ICardinalityEstimator *other);
+        void merge_from(const KMinValuesView &other);
+        virtual ICardinalityEstimator* clone();
+        virtual void serialize(Serializer *serializer);
+        virtual void unserialize(Serializer *serializer);
+};
+
+/* A KMV sketch is a SketchHeader (kind SKETCH_KIND_KMV, param k) followed by
+ * - values encoding: payload_length / 8 distinct uint64 hashes in ascending order, at most k;
+ * - overlap encoding: the state of a KMinValuesOverlap combining aux sketches, as payload_length / 9
+ *   ascending hashes followed by one byte per hash, 1 if every sketch holds it.
+ */
+#define KMV_ENCODING_VALUES 0
+#define KMV_ENCODING_OVERLAP 1
+
+/* Union, intersection and Jaccard index of several KMV sketches
+ *
+ * Keeps the k smallest hashes of the union of all sketches added so far and
+ * marks those that every sketch holds. Each sketch sees all of its hashes up
+ * to its own k-th smallest, which is never below the k-th smallest of the
+ * union, so membership of the union's hashes is exact and the marked fraction
+ * estimates |A n B| / |A u B| (Beyer et al., "On synopses for distinct-value
+ * estimation under multiset operations", 2007). The intersection is that
+ * fraction of the union estimate.
+ *
+ * Sketches with different k can be combined; the result works with the
+ * smallest k. Overlaps of parts of the input combine with merge_from().
+ */
+class KMinValuesOverlap {
+    protected:
+        int k;
+        /* 0 until the first sketch is added */
+        int hash_id;
+        int n_sketches;
+        /* ascending, at most k */
+        std::vector<uint64_t> values;
+        /* common[i]: values[i] is held by every sketch */
+        std::vector<uint8_t> common;
+        void merge(int k, int hash_id, int n_sketches, const uint64_t *values, const uint8_t *common, size_t n);
+    public:
+        /* k: upper bound for the k of the result */
+        KMinValuesOverlap(int k);
+        void add(const KMinValuesView &sketch);
+        void merge_from(const KMinValuesOverlap &other);
+        int sketches() const { return this->n_sketches; }
+        int union_count() const;
+        int intersection_count() const;
+        /* |A n B| / |A u B|, 0 for no sketches */
+        double jaccard() const;
+        /* bytes serialize() writes at most for the given k */
+        static size_t serialized_size(int k);
+        void serialize(Serializer *serializer);
+        void unserialize(Serializer *serializer);
+};
+
+/* Hashes a HyperLogLogCounter buffers before updating its registers */
+#define HLL_PENDING_MAX 65536
+
 /* HyperLogLog estimator
  *
  * Based on https://github.com/JonJanzen/hyperloglog/blob/master/hyperloglog/hll.py
  * and http://blog.aggregateknowledge.com/2012/10/25/sketch-of-the-day-hyperloglog-cornerstone-of-a-big-data-infrastructure/
  */
+/* Per-precision dense register loops, see HyperLogLogCore in CardinalityEstimators.cpp */
+template<class Register> struct HyperLogLogKernels;
+
 class HyperLogLogCounter: public HashingCardinalityEstimator {
     protected:
         std::vector<int> buckets;
         int b;
         int m;
         int m_mask;
-        double get_alpha();
-        int number_of_zero_buckets();
+        const HyperLogLogKernels<int> *kernels;
+        /* For b >= 16 hashes are buffered here and applied by flush() one cache-sized
+         * slice of registers at a time */
+        std::vector<uint64_t> pending;
+        std::vector<uint64_t> scratch;
+        void flush();
+        virtual void add_hashes(const uint64_t *hashes, int n);
     public:
-        /* k: number of bits to use as bucket key. In the range of 4..16. The more, the greater counting precision you get */
-        HyperLogLogCounter(int b);
+        /* b: number of bits to use as bucket key. In the range of 4..20. The more, the greater counting precision you get */
+        HyperLogLogCounter(int b, int hash_id=HASH_DEFAULT);
         virtual void increment(const char *key, int len=-1);
+        virtual void increment_hash(uint64_t hash);
         virtual int count();
         virtual std::string repr();
         virtual void merge_from(ICardinalityEstimator *other);
@@ -96,23 +329,85 @@ class HyperLogLogCounter: public HashingCardinalityEstimator {
         virtual void unserialize(Serializer *serializer);
 };
 
+#define HLL_ENCODING_SPARSE 1
+#define HLL_ENCODING_DENSE 2
+#define HLL_ENCODING_PACKED 3
+#define HLL_ENCODING_EXACT 4
+
+/* A HyperLogLog sketch is a SketchHeader (kind SKETCH_KIND_HYPERLOGLOG, param b) followed by
+ * - sparse encoding: payload_length / 4 uint32 entries (register index << 8 | register value)
+ *   sorted by register index, at most 2^b / 16 of them;
+ * - dense encoding: 2^b one-byte registers;
+ * - packed encoding: dense registers for shipping or storing, as one byte base, one byte width,
+ *   then 2^b (register - base) values of width bits, little-endian, eight registers per width bytes;
+ * - exact encoding: an open-addressing table of payload_length / 8 uint64 hashes (a power of two,
+ *   0 marks an empty slot), holding aux distinct hashes, at most 3/4 full and at most 2^b bytes.
+ */
+
+
+/* HyperLogLog estimator working on an externally provided storage region
+ *
+ * The region starts as an exact set of hashes, so small groups are counted
+ * exactly, and is turned into HyperLogLog registers once the set would
+ * outgrow the dense register array. Registers start in sparse encoding, which
+ * only keeps non-zero registers, and are converted to a dense array of
+ * one-byte registers once the sparse list grows past a quarter of the dense
+ * size. For b <= 15 the whole sketch fits into a single Vertica VARBINARY and
+ * can be updated in place.
+ */
 class HyperLogLogOwnArrayCounter: public HashingCardinalityEstimator {
     protected:
-        uint32_t *buckets[2];
+        SketchHeader *header;
+        uint8_t *buckets;
+        uint32_t *sparse;
         bool own_buckets_memory;
         int b;
         int m;
         int m_mask;
-        double get_alpha();
-        int number_of_zero_buckets();
+        int sparse_max;
+        const HyperLogLogKernels<uint8_t> *kernels;
+        void update_register(int j, uint8_t value);
+        void sparse_update(int j, uint8_t value);
+        uint32_t n_sparse();
+        void set_n_sparse(uint32_t n);
+        void sparse_merge(const uint32_t *other, uint32_t n2);
+        void convert_to_dense();
+        void unpack();
+        void add_hash(uint64_t h);
+        void exact_add(uint64_t h);
+        bool exact_grow();
+        void convert_exact();
+        /* other must already be checked and have the same b and hash */
+        void merge_region(const SketchHeader *other);
+        /* same for a checked sketch of higher precision, folded down to ours */
+        void fold_region(const SketchHeader *other);
+        virtual void add_hashes(const uint64_t *hashes, int n);
     public:
-        /* k: number of bits to use as bucket key. In the range of 4..16. The more, the greater counting precision you get */
-        HyperLogLogOwnArrayCounter(int b, char *storage_region1, char *storage_region2);
+        /* b: number of bits to use as bucket key. In the range of 4..20 (HYPER_LOG_LOG_B_MAX), clamped to it. The more, the greater counting precision you get
+         * storage: region of storage_capacity(b) bytes prepared with init_storage(), or NULL to allocate it internally
+         * hash_id: hash family for an internally allocated region; a provided region keeps the one it was initialized with */
+        HyperLogLogOwnArrayCounter(int b, char *storage, int hash_id=HASH_DEFAULT);
         virtual ~HyperLogLogOwnArrayCounter();
+        /* bytes to reserve for a storage region (dense encoding) */
+        static size_t storage_capacity(int b);
+        /* writes an empty sketch into storage; only the header bytes are touched */
+        static void init_storage(int b, char *storage, int hash_id=HASH_DEFAULT);
+        /* throws if storage[0, len) is not a complete region, e.g. a damaged stored sketch */
+        static void check_storage(const char *storage, size_t len);
+        /* bytes of the storage region currently in use; the region is a sketch in the SketchFormat.h
+         * layout, without a checksum, and can be stored as is or sealed with sketch_seal() */
+        size_t storage_used();
+        bool is_sparse();
+        /* Bit-packs dense registers in place to shrink storage_used(), e.g. before the region
+         * is shipped to another node or stored. Any update unpacks them again */
+        void pack();
         virtual void increment(const char *key, int len=-1);
         virtual int count();
         virtual std::string repr();
         virtual void merge_from(ICardinalityEstimator *other);
+        /* other may have a higher precision: it is folded down to b, which gives the sketch
+         * its hashes would have produced at precision b */
+        void merge_from(const HyperLogLogView &other);
         virtual ICardinalityEstimator* clone();
         virtual void serialize(Serializer *serializer);
         virtual void unserialize(Serializer *serializer);
@@ -124,6 +419,7 @@ class HyperLogLogOwnArrayCounter: public HashingCardinalityEstimator {
 class DummyCounter: public HashingCardinalityEstimator {
     protected:
         int c;
+        virtual void add_hashes(const uint64_t *hashes, int n);
     public:
         DummyCounter(int ignored);
         virtual void increment(const char *key, int len=-1);
@@ -0,0 +1,264 @@
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include <stdint.h>
+
+#include "MurmurHash3.h"
+#include "HashFunctions.h"
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+/******** MurmurHash3 *******/
+
+/* first half of MurmurHash3_x64_128 with seed 0, the hash the library has always used */
+static uint64_t murmur3_hash(const char *key, int len) {
+    uint64_t h[2];
+    MurmurHash3_x64_128(key, len, 0, h);
+    return h[0];
+}
+
+static void murmur3_hash_batch(const char * const *keys, const int *lengths, int n, uint64_t *hashes) {
+    MurmurHash3_x64_64_batch((const void * const *)keys, lengths, n, 0, hashes);
+}
+
+/******** wyhash *******/
+
+/* wyhash final4 by Wang Yi, released into the public domain, with its default secret;
+ * wyhash_test() in test_main.cpp checks it against the reference test vectors.
+ * A 64x64->128 bit multiply folded back to 64 bits does all the mixing, so short
+ * keys cost a couple of loads and two multiplies. */
+
+static const uint64_t wyp0 = 0xa0761d6478bd642fULL;
+static const uint64_t wyp1 = 0xe7037ed1a0b428dbULL;
+static const uint64_t wyp2 = 0x8ebc6af09c88c6e3ULL;
+static const uint64_t wyp3 = 0x589965cc75374cc3ULL;
+
+/* a, b = low and high halves of a * b */
+static inline void wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* 1..3 bytes */
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)key;
+    seed ^= wymix(seed ^ wyp0, wyp1);
+    uint64_t a, b;
+    if (likely(len <= 16)) {
+        if (likely(len >= 4)) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (likely(len > 0)) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (unlikely(i >= 48)) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp1, wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp2, wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp3, wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (likely(i >= 48));
+            seed ^= see1 ^ see2;
+        }
+        while (unlikely(i > 16)) {
+            seed = wymix(wyr8(p) ^ wyp1, wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= wyp1;
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp0 ^ len, b ^ wyp1);
+}
+
+static uint64_t wyhash_hash(const char *key, int len) {
+    return wyhash(key, len, 0);
+}
+
+static void wyhash_hash_batch(const char * const *keys, const int *lengths, int n, uint64_t *hashes) {
+    for (int i = 0; i < n; i++) {
+        hashes[i] = wyhash_hash(keys[i], lengths[i]);
+    }
+}
+
+/* two rounds of the folded multiply: a single round leaves runs of consecutive ids
+ * visibly correlated in the HyperLogLog registers */
+static void wyhash_hash_int_batch(const uint64_t *values, int n, uint64_t *hashes) {
+    for (int i = 0; i < n; i++) {
+        hashes[i] = wymix(wymix(values[i] ^ wyp0, wyp1) ^ wyp2, wyp3);
+    }
+}
+
+/******** Pre-hashed values *******/
+
+static void identity_hash_int_batch(const uint64_t *values, int n, uint64_t *hashes) {
+    memcpy(hashes, values, n * sizeof(uint64_t));
+}
+
+/******** Registry *******/
+
+static const HashFunction hash_functions[] = {
+    { HASH_MURMUR3, "murmur3", murmur3_hash, murmur3_hash_batch, MurmurHash3_fmix64_batch },
+    { HASH_WYHASH, "wyhash", wyhash_hash, wyhash_hash_batch, wyhash_hash_int_batch },
+    { HASH_PREHASHED, "prehashed", wyhash_hash, wyhash_hash_batch, identity_hash_int_batch },
+    { HASH_PREHASHED_FMIX, "prehashed+fmix", wyhash_hash, wyhash_hash_batch, MurmurHash3_fmix64_batch },
+};
+
+const HashFunction *get_hash_function(int id) {
+    for (size_t i = 0; i < sizeof(hash_functions) / sizeof(hash_functions[0]); i++) {
+        if (hash_functions[i].id == id) {
+            return &hash_functions[i];
+        }
+    }
+    char buf[50];
+    sprintf(buf, "unknown hash function id %d", id);
+    throw std::runtime_error(buf);
+}
+
+/******** HashMemo *******/
+
+/* keys looked up before their misses are hashed */
+#define HASH_MEMO_CHUNK 256
+
+HashMemo::HashMemo(int hash_id) {
+    this->hasher = get_hash_function(hash_id);
+    this->enabled = true;
+    this->lookups = 0;
+    this->hits = 0;
+}
+
+/* Reads a key the way wyhash does: for up to 16 bytes, head, tail and the length
+ * determine the key; longer keys have len - 16 more bytes in the middle */
+static inline void hash_memo_read(const char *key, int key_len, uint64_t &head, uint64_t &tail) {
+    const uint8_t *p = (const uint8_t *)key;
+    size_t len = key_len;
+    if (len >= 8) {
+        head = wyr8(p);
+        tail = wyr8(p + len - 8);
+    } else if (len >= 4) {
+        head = wyr4(p);
+        tail = wyr4(p + len - 4);
+    } else if (len > 0) {
+        head = wyr3(p, len);
+        tail = 0;
+    } else {
+        head = tail = 0;
+    }
+}
+
+/* Word w of the middle bytes of a key longer than 16 bytes; the last word is
+ * the one ending at len - 8, so reads never leave the key */
+static inline uint64_t hash_memo_middle(const char *key, int len, int w, int n_words) {
+    return wyr8((const uint8_t *)key + ((w == n_words - 1) ? len - 16 : 8 + 8 * w));
+}
+
+static inline uint32_t hash_memo_slot(uint64_t head, uint64_t tail, int len) {
+    uint64_t h = (head ^ (tail << 29 | tail >> 35) ^ len) * 0x9e3779b97f4a7c15ULL;
+    return h >> (64 - __builtin_ctz(HASH_MEMO_SLOTS));
+}
+
+void HashMemo::hash_batch(const char * const *keys, const int *lengths, int n, uint64_t *hashes) {
+    if (!this->enabled) {
+        this->hasher->hash_batch(keys, lengths, n, hashes);
+        return;
+    }
+    if (this->slots.empty()) {
+        Slot empty;
+        memset(&empty, 0, sizeof(empty));
+        empty.len = -1;
+        this->slots.assign(HASH_MEMO_SLOTS, empty);
+    }
+
+    // hits are taken without branching on them, misses are hashed together afterwards
+    const char *miss_keys[HASH_MEMO_CHUNK];
+    int miss_lengths[HASH_MEMO_CHUNK];
+    int miss_index[HASH_MEMO_CHUNK];
+    uint64_t miss_hashes[HASH_MEMO_CHUNK];
+    for (int start = 0; start < n; start += HASH_MEMO_CHUNK) {
+        int end = std::min(n, start + HASH_MEMO_CHUNK);
+        int n_misses = 0;
+        for (int i = start; i < end; i++) {
+            int len = lengths[i];
+            uint64_t head, tail;
+            hash_memo_read(keys[i], len, head, tail);
+            const Slot &slot = this->slots[hash_memo_slot(head, tail, len)];
+            bool hit = (slot.len == len) & (slot.head == head) & (slot.tail == tail);
+            if (len > 16) {
+                int n_words = std::min(len - 9, HASH_MEMO_KEY_MAX - 9) / 8;
+                uint64_t diff = 0;
+                for (int w = 0; w < n_words; w++) {
+                    diff |= hash_memo_middle(keys[i], len, w, n_words) ^ slot.middle[w];
+                }
+                hit &= (diff == 0);
+            }
+            hashes[i] = slot.hash;
+            miss_keys[n_misses] = keys[i];
+            miss_lengths[n_misses] = len;
+            miss_index[n_misses] = i;
+            n_misses += !hit;
+        }
+        this->hasher->hash_batch(miss_keys, miss_lengths, n_misses, miss_hashes);
+        for (int j = 0; j < n_misses; j++) {
+            hashes[miss_index[j]] = miss_hashes[j];
+            int len = miss_lengths[j];
+            if (len <= HASH_MEMO_KEY_MAX) {
+                uint64_t head, tail;
+                hash_memo_read(miss_keys[j], len, head, tail);
+                Slot &slot = this->slots[hash_memo_slot(head, tail, len)];
+                slot.hash = miss_hashes[j];
+                slot.head = head;
+                slot.tail = tail;
+                slot.len = len;
+                int n_words = (len > 16) ? (len - 9) / 8 : 0;
+                for (int w = 0; w < n_words; w++) {
+                    slot.middle[w] = hash_memo_middle(miss_keys[j], len, w, n_words);
+                }
+            }
+        }
+        this->lookups += end - start;
+        this->hits += end - start - n_misses;
+    }
+
+    if (this->lookups >= HASH_MEMO_WINDOW) {
+        if (4 * this->hits < 3 * this->lookups) {
+            this->enabled = false;
+            std::vector<Slot>().swap(this->slots);
+        }
+        this->lookups = 0;
+        this->hits = 0;
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef _HASH_FUNCTIONS_H
+#define _HASH_FUNCTIONS_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hash family identifiers. They are stored inside sketches, so never renumber them;
+ * 0 is left unused to catch uninitialized sketch headers. */
+#define HASH_MURMUR3 1
+#define HASH_WYHASH 2
+/* Values that are 64-bit hashes already, e.g. computed at ETL time: fixed-width values are
+ * used as they are. Strings are hashed with wyhash */
+#define HASH_PREHASHED 3
+/* Same, for hashes that may be poorly mixed (ids, Vertica's HASH()): fixed-width values only
+ * go through the MurmurHash3 fmix64 finaliser */
+#define HASH_PREHASHED_FMIX 4
+
+/* Used by estimators unless told otherwise; see benchmark_hashes() in test_main.cpp */
+#define HASH_DEFAULT HASH_WYHASH
+
+/* A family of 64-bit hashes: one for byte strings and one for fixed-width values.
+ *
+ * Both members of a family must be used consistently for a sketch, and
+ * sketches built with different families cannot be merged.
+ */
+struct HashFunction {
+    int id;
+    const char *name;
+    uint64_t (*hash)(const char *key, int len);
+    /* hashes[i] = hash(keys[i], lengths[i]) */
+    void (*hash_batch)(const char * const *keys, const int *lengths, int n, uint64_t *hashes);
+    /* spreads the bits of fixed-width values over the whole word */
+    void (*hash_int_batch)(const uint64_t *values, int n, uint64_t *hashes);
+};
+
+/* wyhash final4 with its default secret; HASH_WYHASH hashes strings with seed 0 */
+uint64_t wyhash(const void *key, size_t len, uint64_t seed);
+
+/* Returns the hash family with the given id; throws std::runtime_error for unknown ids */
+const HashFunction *get_hash_function(int id);
+
+#define HASH_MEMO_SLOTS 2048
+/* longer keys are always hashed */
+#define HASH_MEMO_KEY_MAX 48
+/* lookups between hit rate checks */
+#define HASH_MEMO_WINDOW 8192
+
+/*
+ * Direct-mapped cache of string hashes for low-cardinality columns (country
+ * codes, device types, campaign names), where the same few hundred strings are
+ * hashed millions of times.
+ *
+ * The first and last 8 bytes of a key and its length pick the slot; for keys
+ * of up to 16 bytes they also are the whole key. Longer keys keep their middle
+ * bytes in the slot as words, so a hit is verified by comparing a few words
+ * rather than calling memcmp. The cache turns itself off for good the first
+ * time fewer than 3/4 of a window of lookups hit, after which hash_batch()
+ * costs one branch more than the family's own.
+ *
+ * A lookup costs about as much as wyhash of a short key, so the cache only
+ * pays off in front of MurmurHash3, where hits are 1.5-2x faster.
+ *
+ * Meant to live as long as an aggregate, across many estimators and blocks.
+ */
+class HashMemo {
+    protected:
+        struct Slot {
+            uint64_t hash;
+            uint64_t head;
+            uint64_t tail;
+            /* -1 for an empty slot */
+            int64_t len;
+            /* bytes [8, len - 8) of longer keys, see hash_memo_middle() */
+            uint64_t middle[(HASH_MEMO_KEY_MAX - 16) / 8];
+        };
+        const HashFunction *hasher;
+        std::vector<Slot> slots;
+        bool enabled;
+        int lookups;
+        int hits;
+    public:
+        HashMemo(int hash_id);
+        const HashFunction *hash_function() const { return this->hasher; }
+        bool is_enabled() const { return this->enabled; }
+        /* Same as hash_function()->hash_batch() */
+        void hash_batch(const char * const *keys, const int *lengths, int n, uint64_t *hashes);
+};
+
+#endif
@@ -333,3 +333,251 @@ void MurmurHash3_x64_128 ( const void * key, const int len,
 
 //-----------------------------------------------------------------------------
 
+// Batch variant of MurmurHash3_x64_128 returning only the first 64 bits of
+// each hash. Results are bit-identical to out[0] of the scalar function.
+//
+// On x86-64 CPUs with AVX2 four keys are hashed at once, one per 64-bit lane.
+// AVX2 has no 64x64 bit multiply, so it is assembled from three 32x32 ones.
+
+static inline uint64_t MurmurHash3_x64_64 ( const void * key, int len, uint32_t seed )
+{
+  uint64_t h[2];
+  MurmurHash3_x64_128(key, len, seed, h);
+  return h[0];
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+#include <string.h>
+
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+AVX2_FUNCTION static inline __m256i mul64_x4 ( __m256i a, __m256i b )
+{
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i hi1 = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+  __m256i hi2 = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(_mm256_add_epi64(hi1, hi2), 32));
+}
+
+#define ROTL64_X4(x,r) _mm256_or_si256(_mm256_slli_epi64(x, r), _mm256_srli_epi64(x, 64 - (r)))
+
+AVX2_FUNCTION static inline __m256i fmix64_x4 ( __m256i k )
+{
+  const __m256i f1 = _mm256_set1_epi64x(BIG_CONSTANT(0xff51afd7ed558ccd));
+  const __m256i f2 = _mm256_set1_epi64x(BIG_CONSTANT(0xc4ceb9fe1a85ec53));
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+  k = mul64_x4(k, f1);
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+  k = mul64_x4(k, f2);
+  k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+  return k;
+}
+
+// Byte table for extracting the 1..15 byte tail of a long key with one 16-byte load
+static const uint8_t tail_shift_window[32] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80
+};
+
+static inline uint64_t load_u64 ( const uint8_t * p )
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t load_u32 ( const uint8_t * p )
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Returns the tail of a key zero-padded to 16 bytes without reading outside of
+// the key: keys come from VStrings and BlockReader buffers, whose ends may be
+// followed by anything, so short keys are assembled from overlapping loads
+AVX2_FUNCTION static inline __m128i load_tail ( const uint8_t * data, int len )
+{
+  int t = len & 15;
+  if(t == 0) return _mm_setzero_si128();
+  if(len >= 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(data + len - 16));
+    return _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)(tail_shift_window + 16 - t)));
+  }
+  uint64_t lo, hi = 0;
+  if(t >= 8)
+  {
+    lo = load_u64(data);
+    if(t > 8) hi = load_u64(data + t - 8) >> (8 * (16 - t));
+  }
+  else if(t >= 4)
+  {
+    lo = load_u32(data) | (load_u32(data + t - 4) << (8 * (t - 4)));
+  }
+  else
+  {
+    lo = data[0] | ((uint64_t)data[t / 2] << (8 * (t / 2))) | ((uint64_t)data[t - 1] << (8 * (t - 1)));
+  }
+  return _mm_set_epi64x(hi, lo);
+}
+
+// Splits four 16-byte blocks into a vector of their first and a vector of
+// their second 64-bit words. Lanes come out in 0, 2, 1, 3 order.
+AVX2_FUNCTION static inline void transpose_x4 ( __m128i b0, __m128i b1, __m128i b2, __m128i b3,
+                                                __m256i & k1, __m256i & k2 )
+{
+  __m256i b01 = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+  __m256i b23 = _mm256_inserti128_si256(_mm256_castsi128_si256(b2), b3, 1);
+  k1 = _mm256_unpacklo_epi64(b01, b23);
+  k2 = _mm256_unpackhi_epi64(b01, b23);
+}
+
+AVX2_FUNCTION static inline __m128i load_block ( const uint8_t * data, int nblocks, int i )
+{
+  return (i < nblocks) ? _mm_loadu_si128((const __m128i*)(data + i * 16)) : _mm_setzero_si128();
+}
+
+// Hashes 4 * G keys, keeping G independent groups of four lanes in flight so
+// that the long multiply chains of one group overlap with those of the other.
+template<int G>
+AVX2_FUNCTION static void MurmurHash3_x64_64_x4 ( const void * const * keys, const int * len,
+                                                  uint32_t seed, uint64_t * out )
+{
+  const __m256i c1 = _mm256_set1_epi64x(BIG_CONSTANT(0x87c37b91114253d5));
+  const __m256i c2 = _mm256_set1_epi64x(BIG_CONSTANT(0x4cf5ad432745937f));
+  const __m256i n1 = _mm256_set1_epi64x(0x52dce729);
+  const __m256i n2 = _mm256_set1_epi64x(0x38495ab5);
+
+  const uint8_t * data[4 * G];
+  int nblocks[4 * G];
+  int max_blocks = 0;
+  for(int lane = 0; lane < 4 * G; lane++)
+  {
+    data[lane] = (const uint8_t*)keys[lane];
+    nblocks[lane] = len[lane] / 16;
+    if(nblocks[lane] > max_blocks) max_blocks = nblocks[lane];
+  }
+
+  __m256i lane_blocks[G], h1[G], h2[G], k1[G], k2[G];
+  for(int g = 0; g < G; g++)
+  {
+    const int * nb = nblocks + 4 * g;
+    // lane order 0, 2, 1, 3 to match transpose_x4()
+    lane_blocks[g] = _mm256_set_epi64x(nb[3], nb[1], nb[2], nb[0]);
+    h1[g] = _mm256_set1_epi64x(seed);
+    h2[g] = _mm256_set1_epi64x(seed);
+  }
+
+  //----------
+  // body: lanes that have already run out of full blocks keep their state
+
+  for(int i = 0; i < max_blocks; i++)
+  {
+    for(int g = 0; g < G; g++)
+    {
+      const uint8_t * const * d = data + 4 * g;
+      const int * nb = nblocks + 4 * g;
+      transpose_x4(load_block(d[0], nb[0], i), load_block(d[1], nb[1], i),
+                   load_block(d[2], nb[2], i), load_block(d[3], nb[3], i), k1[g], k2[g]);
+      __m256i active = _mm256_cmpgt_epi64(lane_blocks[g], _mm256_set1_epi64x(i));
+
+      k1[g] = mul64_x4(k1[g], c1); k1[g] = ROTL64_X4(k1[g], 31); k1[g] = mul64_x4(k1[g], c2);
+      __m256i b1 = _mm256_xor_si256(h1[g], k1[g]);
+      b1 = ROTL64_X4(b1, 27); b1 = _mm256_add_epi64(b1, h2[g]);
+      b1 = _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(b1, 2), b1), n1);
+
+      k2[g] = mul64_x4(k2[g], c2); k2[g] = ROTL64_X4(k2[g], 33); k2[g] = mul64_x4(k2[g], c1);
+      __m256i b2 = _mm256_xor_si256(h2[g], k2[g]);
+      b2 = ROTL64_X4(b2, 31); b2 = _mm256_add_epi64(b2, b1);
+      b2 = _mm256_add_epi64(_mm256_add_epi64(_mm256_slli_epi64(b2, 2), b2), n2);
+
+      h1[g] = _mm256_blendv_epi8(h1[g], b1, active);
+      h2[g] = _mm256_blendv_epi8(h2[g], b2, active);
+    }
+  }
+
+  for(int g = 0; g < G; g++)
+  {
+    const uint8_t * const * d = data + 4 * g;
+    const int * l = len + 4 * g;
+
+    //----------
+    // tail: an all-zero tail word leaves h1/h2 unchanged, so short tails need no masking
+
+    transpose_x4(load_tail(d[0], l[0]), load_tail(d[1], l[1]),
+                 load_tail(d[2], l[2]), load_tail(d[3], l[3]), k1[g], k2[g]);
+
+    k2[g] = mul64_x4(k2[g], c2); k2[g] = ROTL64_X4(k2[g], 33); k2[g] = mul64_x4(k2[g], c1);
+    h2[g] = _mm256_xor_si256(h2[g], k2[g]);
+    k1[g] = mul64_x4(k1[g], c1); k1[g] = ROTL64_X4(k1[g], 31); k1[g] = mul64_x4(k1[g], c2);
+    h1[g] = _mm256_xor_si256(h1[g], k1[g]);
+
+    //----------
+    // finalization
+
+    __m256i vlen = _mm256_set_epi64x(l[3], l[1], l[2], l[0]);
+    h1[g] = _mm256_xor_si256(h1[g], vlen);
+    h2[g] = _mm256_xor_si256(h2[g], vlen);
+
+    h1[g] = _mm256_add_epi64(h1[g], h2[g]);
+    h2[g] = _mm256_add_epi64(h2[g], h1[g]);
+
+    h1[g] = fmix64_x4(h1[g]);
+    h2[g] = fmix64_x4(h2[g]);
+
+    h1[g] = _mm256_add_epi64(h1[g], h2[g]);
+
+    // back to lane order 0, 1, 2, 3
+    _mm256_storeu_si256((__m256i*)(out + 4 * g), _mm256_permute4x64_epi64(h1[g], 0xd8));
+  }
+}
+
+void MurmurHash3_x64_64_batch ( const void * const * keys, const int * len, int n,
+                                uint32_t seed, uint64_t * out )
+{
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  int i = 0;
+  if(has_avx2)
+  {
+    for(; i + 8 <= n; i += 8)
+    {
+      MurmurHash3_x64_64_x4<2>(keys + i, len + i, seed, out + i);
+    }
+    for(; i + 4 <= n; i += 4)
+    {
+      MurmurHash3_x64_64_x4<1>(keys + i, len + i, seed, out + i);
+    }
+  }
+  for(; i < n; i++)
+  {
+    out[i] = MurmurHash3_x64_64(keys[i], len[i], seed);
+  }
+}
+
+#else // defined(__x86_64__) && defined(__GNUC__)
+
+void MurmurHash3_x64_64_batch ( const void * const * keys, const int * len, int n,
+                                uint32_t seed, uint64_t * out )
+{
+  for(int i = 0; i < n; i++)
+  {
+    out[i] = MurmurHash3_x64_64(keys[i], len[i], seed);
+  }
+}
+
+#endif // defined(__x86_64__) && defined(__GNUC__)
+
+//-----------------------------------------------------------------------------
+
+void MurmurHash3_fmix64_batch ( const uint64_t * values, int n, uint64_t * out )
+{
+  for(int i = 0; i < n; i++)
+  {
+    out[i] = fmix64(values[i]);
+  }
+}
+
+//-----------------------------------------------------------------------------
@@ -32,6 +32,12 @@ void MurmurHash3_x86_128 ( const void * key, int len, uint32_t seed, void * out
 
 void MurmurHash3_x64_128 ( const void * key, int len, uint32_t seed, void * out );
 
+// First 64 bits of MurmurHash3_x64_128 for n keys, using SIMD lanes where available
+void MurmurHash3_x64_64_batch ( const void * const * keys, const int * len, int n, uint32_t seed, uint64_t * out );
+
+// MurmurHash3 64-bit finalizer applied to n fixed-width values; a bijection, so distinct values never collide
+void MurmurHash3_fmix64_batch ( const uint64_t * values, int n, uint64_t * out );
+
 //-----------------------------------------------------------------------------
 
 #endif // _MURMURHASH3_H_
@@ -0,0 +1,176 @@
+#include "RegisterKernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+/******** Scalar kernels *******/
+
+static void registers_max_u8_scalar(uint8_t *dst, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (src[i] > dst[i]) ? src[i] : dst[i];
+    }
+}
+
+static void registers_max_i32_scalar(int *dst, const int *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (src[i] > dst[i]) ? src[i] : dst[i];
+    }
+}
+
+static void words_or_u64_scalar(uint64_t *dst, const uint64_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] |= src[i];
+    }
+}
+
+/* Four partial histograms, so runs of equal registers do not serialize on one counter */
+void registers_histogram_u8(const uint8_t *regs, size_t n, uint32_t *hist) {
+    uint32_t partial[4][256];
+    memset(partial, 0, sizeof(partial));
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        partial[0][regs[i]]++;
+        partial[1][regs[i + 1]]++;
+        partial[2][regs[i + 2]]++;
+        partial[3][regs[i + 3]]++;
+    }
+    for (; i < n; i++) {
+        partial[0][regs[i]]++;
+    }
+    for (int v = 0; v < 256; v++) {
+        hist[v] = partial[0][v] + partial[1][v] + partial[2][v] + partial[3][v];
+    }
+}
+
+void registers_histogram_i32(const int *regs, size_t n, uint32_t *hist) {
+    memset(hist, 0, 256 * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        int v = regs[i];
+        hist[(v < 0) ? 0 : (v > 255) ? 255 : v]++;
+    }
+}
+
+static size_t words_popcount_u64_scalar(const uint64_t *words, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
+
+/******** AVX2 kernels *******/
+
+#ifdef HAVE_AVX2_KERNELS
+
+static bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+
+static bool cpu_has_popcnt() {
+    static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+    return has_popcnt;
+}
+
+/* without -mpopcnt the builtin is a table-free bit trick; with it a single instruction.
+ * Independent accumulators keep several popcnt in flight. */
+__attribute__((target("popcnt"))) static size_t words_popcount_u64_popcnt(const uint64_t *words, size_t n) {
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        c0 += __builtin_popcountll(words[i]);
+        c1 += __builtin_popcountll(words[i + 1]);
+        c2 += __builtin_popcountll(words[i + 2]);
+        c3 += __builtin_popcountll(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        c0 += __builtin_popcountll(words[i]);
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+/* two vectors per iteration, the loops are bound by loads and stores */
+AVX2_FUNCTION static void registers_max_u8_avx2(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epu8(a0, b0));
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_max_epu8(a1, b1));
+    }
+    registers_max_u8_scalar(dst + i, src + i, n - i);
+}
+
+AVX2_FUNCTION static void registers_max_i32_avx2(int *dst, const int *src, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 8));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epi32(a0, b0));
+        _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_max_epi32(a1, b1));
+    }
+    registers_max_i32_scalar(dst + i, src + i, n - i);
+}
+
+AVX2_FUNCTION static void words_or_u64_avx2(uint64_t *dst, const uint64_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + i + 4));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + i + 4));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a0, b0));
+        _mm256_storeu_si256((__m256i *)(dst + i + 4), _mm256_or_si256(a1, b1));
+    }
+    words_or_u64_scalar(dst + i, src + i, n - i);
+}
+
+#endif
+
+/******** Dispatch *******/
+
+void registers_max_u8(uint8_t *dst, const uint8_t *src, size_t n) {
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2()) {
+        registers_max_u8_avx2(dst, src, n);
+        return;
+    }
+#endif
+    registers_max_u8_scalar(dst, src, n);
+}
+
+void registers_max_i32(int *dst, const int *src, size_t n) {
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2()) {
+        registers_max_i32_avx2(dst, src, n);
+        return;
+    }
+#endif
+    registers_max_i32_scalar(dst, src, n);
+}
+
+void words_or_u64(uint64_t *dst, const uint64_t *src, size_t n) {
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2()) {
+        words_or_u64_avx2(dst, src, n);
+        return;
+    }
+#endif
+    words_or_u64_scalar(dst, src, n);
+}
+
+size_t words_popcount_u64(const uint64_t *words, size_t n) {
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_popcnt()) {
+        return words_popcount_u64_popcnt(words, n);
+    }
+#endif
+    return words_popcount_u64_scalar(words, n);
+}
@@ -0,0 +1,32 @@
+#ifndef _REGISTER_KERNELS_H
+#define _REGISTER_KERNELS_H
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+/*
+ * Bulk loops over estimator registers.
+ *
+ * Each kernel has a scalar version and an AVX2 version; the AVX2 one is picked
+ * at runtime when the CPU supports it, so the library can still be built
+ * without -march flags and loaded on any x86-64 node.
+ */
+
+/* dst[i] = max(dst[i], src[i]) for one-byte registers */
+void registers_max_u8(uint8_t *dst, const uint8_t *src, size_t n);
+
+/* dst[i] = max(dst[i], src[i]) for int registers */
+void registers_max_i32(int *dst, const int *src, size_t n);
+
+/* dst[i] |= src[i] for bitset words */
+void words_or_u64(uint64_t *dst, const uint64_t *src, size_t n);
+
+/* number of set bits in n bitset words */
+size_t words_popcount_u64(const uint64_t *words, size_t n);
+
+/* hist[v] = number of registers equal to v, for v in 0..255 (int registers are clamped to that range) */
+void registers_histogram_u8(const uint8_t *regs, size_t n, uint32_t *hist);
+void registers_histogram_i32(const int *regs, size_t n, uint32_t *hist);
+
+#endif
@@ -2,9 +2,17 @@
 #define _SERIALIZER_H
 
 #include <vector>
+#include <algorithm>
 #include <stdexcept>
 #include <cstdio>
-
+#include <cstring>
+#include <stdint.h>
+
+/*
+ * Reads and writes a byte stream over a list of fixed-size containers, e.g.
+ * several VARBINARY intermediate columns. Values may straddle the boundary
+ * between two containers; the stream is the concatenation of the containers.
+ */
 class Serializer {
     protected:
         std::vector<char *> storage;
@@ -12,18 +20,21 @@ class Serializer {
         size_t storage_i;
         size_t storage_pos;
 
-        void check_remaining_space_and_switch_container_if_needed(size_t required_space) {
-            if (this->storage.size() > 0) {
-                if (this->storage_pos + required_space < this->storage_size[this->storage_i]) {
-                    return;
-                }
-                // not enough space in current container
-                if (this->storage.size() > this->storage_i + 1) {
-                    // advancing to a new shiny container
-                    this->storage_i += 1;
-                    this->storage_pos = 0;
-                    return;
-                }
+        /* Bytes between the current position and the end of the last container */
+        size_t remaining() {
+            if (this->storage_i >= this->storage.size()) {
+                return 0;
+            }
+            size_t s = this->storage_size[this->storage_i] - this->storage_pos;
+            for (size_t i = this->storage_i + 1; i < this->storage.size(); i++) {
+                s += this->storage_size[i];
+            }
+            return s;
+        }
+
+        void check_remaining_space(size_t required_space) {
+            if (required_space <= this->remaining()) {
+                return;
             }
             char buf[100];
             sprintf(buf, "Not enough space: size %lu, capacity %lu, requested %lu",
@@ -31,6 +42,19 @@ class Serializer {
             throw std::runtime_error(buf);
         }
 
+        /* Contiguous bytes left in the current container, moving on to the next one if it is used up */
+        size_t current_chunk() {
+            while (this->storage_i + 1 < this->storage.size() &&
+                    this->storage_pos == this->storage_size[this->storage_i]) {
+                this->storage_i += 1;
+                this->storage_pos = 0;
+            }
+            if (this->storage_i >= this->storage.size()) {
+                return 0;
+            }
+            return this->storage_size[this->storage_i] - this->storage_pos;
+        }
+
     public:
         Serializer(): storage(), storage_size() {
             this->storage_i = 0;
@@ -40,7 +64,7 @@ class Serializer {
         void free_containers() {
             while (!this->storage.empty()) {
                 char *data = this->storage.back();
-                delete data;
+                delete[] data;
                 this->storage.pop_back();
                 this->storage_size.pop_back();
             }
@@ -65,6 +89,14 @@ class Serializer {
             return s;
         }
 
+        /* Bytes of container i covered by what was written (or read) so far */
+        size_t container_used(size_t i) {
+            if (i < this->storage_i) {
+                return this->storage_size[i];
+            }
+            return (i == this->storage_i) ? this->storage_pos : 0;
+        }
+
         void add_storage(char *data, size_t len) {
             this->storage.push_back(data);
             this->storage_size.push_back(len);
@@ -76,31 +108,50 @@ class Serializer {
         }
 
         bool eof() {
-            if (this->storage.size() == 0) return true;
-            if (this->storage_i < this->storage.size() - 1) return false;
-            if (this->storage_pos < this->storage_size[this->storage_i] - 1) return false;
-            return true;
-        }
-
-        /* Warning: works only if data fits completely in the current storage container. */
-        void write(char *data, size_t len) {
-            this->check_remaining_space_and_switch_container_if_needed(len);
-            size_t i;
-            char *dest = this->storage[this->storage_i] + this->storage_pos;
-            for (i = 0; i < len; i++) {
-                *dest++ = *data++;
+            return this->remaining() == 0;
+        }
+
+        /* Copies len bytes to the stream, splitting them between containers where needed */
+        void write_span(const char *data, size_t len) {
+            this->check_remaining_space(len);
+            while (len > 0) {
+                size_t chunk = std::min(len, this->current_chunk());
+                memcpy(this->storage[this->storage_i] + this->storage_pos, data, chunk);
+                this->storage_pos += chunk;
+                data += chunk;
+                len -= chunk;
             }
-            this->storage_pos += len;
         }
 
-        void read(char *data, size_t len) {
-            this->check_remaining_space_and_switch_container_if_needed(len);
-            size_t i;
-            char *src = this->storage[this->storage_i] + this->storage_pos;
-            for (i = 0; i < len; i++) {
-                *data++ = *src++;
+        void read_span(char *data, size_t len) {
+            this->check_remaining_space(len);
+            while (len > 0) {
+                size_t chunk = std::min(len, this->current_chunk());
+                memcpy(data, this->storage[this->storage_i] + this->storage_pos, chunk);
+                this->storage_pos += chunk;
+                data += chunk;
+                len -= chunk;
+            }
+        }
+
+        /* Returns the next len bytes in place and skips past them, or NULL (without moving)
+         * when they are split between containers and have to be copied out with read_span() */
+        const char *borrow(size_t len) {
+            this->check_remaining_space(len);
+            if (this->current_chunk() < len) {
+                return NULL;
             }
+            const char *data = this->storage[this->storage_i] + this->storage_pos;
             this->storage_pos += len;
+            return data;
+        }
+
+        void write(const char *data, size_t len) {
+            this->write_span(data, len);
+        }
+
+        void read(char *data, size_t len) {
+            this->read_span(data, len);
         }
 
         void write_int(int x) {
@@ -115,6 +166,10 @@ class Serializer {
             this->write((char *)&x, (size_t)sizeof(uint32_t));
         }
 
+        void write_uint8_t(uint8_t x) {
+            this->write((char *)&x, (size_t)sizeof(uint8_t));
+        }
+
         int read_int() {
             int r;
             this->read((char *)&r, (size_t)sizeof(int));
@@ -132,6 +187,12 @@ class Serializer {
             this->read((char *)&r, (size_t)sizeof(uint32_t));
             return r;
         }
+
+        uint8_t read_uint8_t() {
+            uint8_t r;
+            this->read((char *)&r, (size_t)sizeof(uint8_t));
+            return r;
+        }
 };
 
 #endif
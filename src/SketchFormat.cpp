@@ -0,0 +1,125 @@
+#include <stdexcept>
+#include <cstring>
+
+#include "SketchFormat.h"
+#include "HashFunctions.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+/******** CRC32C *******/
+
+/* reflected Castagnoli polynomial, the one implemented by the SSE4.2 crc32 instruction */
+#define CRC32C_POLY 0x82f63b78
+
+struct Crc32cTable {
+    uint32_t entries[256];
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            }
+            this->entries[i] = c;
+        }
+    }
+};
+
+static uint32_t crc32c_scalar(const char *data, size_t len, uint32_t crc) {
+    static const Crc32cTable table;
+    for (size_t i = 0; i < len; i++) {
+        crc = table.entries[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const char *data, size_t len, uint32_t crc) {
+    uint64_t c = crc;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = (uint32_t)c;
+    for (; i < len; i++) {
+        c32 = _mm_crc32_u8(c32, (uint8_t)data[i]);
+    }
+    return c32;
+}
+
+static bool cpu_has_sse42() {
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    return has_sse42;
+}
+
+#endif
+
+uint32_t crc32c(const char *data, size_t len, uint32_t crc) {
+    crc = ~crc;
+#ifdef HAVE_SSE42_CRC
+    if (cpu_has_sse42()) {
+        return ~crc32c_sse42(data, len, crc);
+    }
+#endif
+    return ~crc32c_scalar(data, len, crc);
+}
+
+/******** Header *******/
+
+void sketch_header_init(SketchHeader *header, int kind, uint32_t param, int hash_id, int encoding) {
+    header->magic = SKETCH_MAGIC;
+    header->version = SKETCH_FORMAT_VERSION;
+    header->kind = kind;
+    header->hash_id = hash_id;
+    header->encoding = encoding;
+    header->flags = 0;
+    header->reserved = 0;
+    header->param = param;
+    header->payload_length = 0;
+    header->crc32c = 0;
+    header->aux = 0;
+}
+
+void sketch_seal(SketchHeader *header) {
+    header->crc32c = crc32c(sketch_payload(header), header->payload_length);
+    header->flags |= SKETCH_FLAG_CRC32C;
+}
+
+void sketch_check_header(const SketchHeader *header, int kind) {
+    if (header->magic != SKETCH_MAGIC) {
+        throw std::runtime_error("not a sketch: bad magic");
+    }
+    if (header->version == 0 || header->version > SKETCH_FORMAT_VERSION) {
+        throw std::runtime_error("sketch format version is not supported");
+    }
+    if (header->kind != kind) {
+        throw std::runtime_error("sketch was built by a different estimator");
+    }
+    get_hash_function(header->hash_id);
+}
+
+void sketch_check_payload(const SketchHeader *header, const char *payload) {
+    if ((header->flags & SKETCH_FLAG_CRC32C) &&
+            crc32c(payload, header->payload_length) != header->crc32c) {
+        throw std::runtime_error("sketch checksum mismatch");
+    }
+}
+
+const SketchHeader *sketch_check(const char *data, size_t len, int kind) {
+    if (len < sizeof(SketchHeader)) {
+        throw std::runtime_error("sketch is truncated");
+    }
+    const SketchHeader *header = (const SketchHeader *)data;
+    sketch_check_header(header, kind);
+    if (len < sketch_size(header)) {
+        throw std::runtime_error("sketch is truncated");
+    }
+    sketch_check_payload(header, sketch_payload(header));
+    return header;
+}
@@ -0,0 +1,75 @@
+#ifndef _SKETCH_FORMAT_H
+#define _SKETCH_FORMAT_H
+
+#include <cstddef>
+#include <stdint.h>
+
+/*
+ * Binary layout of stored sketches.
+ *
+ * Every sketch starts with a SketchHeader followed by payload_length bytes of
+ * estimator-specific payload. The header says what the payload is, so a stored
+ * value can be checked and read in place without knowing how it was produced.
+ * Fields are stored in host byte order; the library only targets x86-64, so
+ * that is little-endian.
+ */
+
+#define SKETCH_MAGIC 0x4b53 /* "SK" */
+/* Bump when the layout of the header or of any payload changes; readers reject newer versions */
+#define SKETCH_FORMAT_VERSION 1
+
+/* Estimator kinds. Stored inside sketches, so never renumber them */
+#define SKETCH_KIND_HYPERLOGLOG 1
+#define SKETCH_KIND_LINEAR 2
+#define SKETCH_KIND_KMV 3
+
+/* crc32c holds the CRC32C of the payload */
+#define SKETCH_FLAG_CRC32C 1
+
+struct SketchHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t kind;
+    uint8_t hash_id;
+    /* kind-specific, e.g. HLL_ENCODING_SPARSE */
+    uint8_t encoding;
+    uint8_t flags;
+    uint8_t reserved;
+    /* b for HyperLogLog, bitset size for linear counting, k for KMV */
+    uint32_t param;
+    uint32_t payload_length;
+    uint32_t crc32c;
+    /* kind-specific, e.g. the number of hashes in an exact HyperLogLog sketch */
+    uint32_t aux;
+};
+
+/* Fills in a header for an empty payload without a checksum */
+void sketch_header_init(SketchHeader *header, int kind, uint32_t param, int hash_id, int encoding);
+
+inline const char *sketch_payload(const SketchHeader *header) {
+    return (const char *)(header + 1);
+}
+
+inline char *sketch_payload(SketchHeader *header) {
+    return (char *)(header + 1);
+}
+
+inline size_t sketch_size(const SketchHeader *header) {
+    return sizeof(SketchHeader) + header->payload_length;
+}
+
+/* Computes the checksum of a contiguous payload following the header and sets SKETCH_FLAG_CRC32C */
+void sketch_seal(SketchHeader *header);
+
+/* Throws std::runtime_error unless the header is a known version of the given kind with a known hash */
+void sketch_check_header(const SketchHeader *header, int kind);
+
+/* Throws std::runtime_error if the header carries a checksum and payload does not match it */
+void sketch_check_payload(const SketchHeader *header, const char *payload);
+
+/* Checks that data[0, len) holds a complete, intact sketch of the given kind and returns its header */
+const SketchHeader *sketch_check(const char *data, size_t len, int kind);
+
+uint32_t crc32c(const char *data, size_t len, uint32_t crc=0);
+
+#endif
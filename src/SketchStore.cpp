@@ -0,0 +1,259 @@
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "SketchStore.h"
+
+#define SKETCH_STORE_MAGIC "SKSTORE"
+#define SKETCH_STORE_VERSION 1
+/* records reserved when a store is created; the file doubles whenever it runs out */
+#define SKETCH_STORE_INITIAL_RECORDS 64
+
+/* Fields are stored in host byte order, like the sketches themselves */
+struct SketchStoreFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t b;
+    uint32_t hash_id;
+    uint32_t n_levels;
+    /* records in use; only bumped once a new record is fully initialized */
+    uint64_t n_records;
+    uint64_t capacity;
+    int64_t level_seconds[SKETCH_STORE_LEVELS];
+};
+
+/* Followed by a HyperLogLogOwnArrayCounter storage region */
+struct SketchStoreRecord {
+    char key[SKETCH_STORE_KEY_MAX];
+    int64_t start;
+    uint32_t level;
+    uint32_t reserved;
+};
+
+const int64_t SketchStore::level_seconds[SKETCH_STORE_LEVELS] = {
+    60, 3600, 86400, 4 * 86400, 16 * 86400, 64 * 86400, 256 * 86400,
+};
+
+static void throw_errno(const std::string &what) {
+    throw std::runtime_error("sketch store: " + what + ": " + strerror(errno));
+}
+
+bool SketchStore::BucketId::operator<(const BucketId &other) const {
+    if (this->level != other.level) {
+        return this->level < other.level;
+    }
+    if (this->start != other.start) {
+        return this->start < other.start;
+    }
+    return this->key < other.key;
+}
+
+SketchStore::SketchStore(const std::string &path, int b, int hash_id) {
+    this->data = NULL;
+    this->mapped_size = 0;
+    this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (this->fd < 0) {
+        throw_errno("cannot open " + path);
+    }
+    try {
+        struct stat st;
+        if (fstat(this->fd, &st) != 0) {
+            throw_errno("cannot stat " + path);
+        }
+        if (st.st_size == 0) {
+            if (b < 4 || b > 20) {
+                throw std::runtime_error("sketch store: precision must be between 4 and 20");
+            }
+            get_hash_function(hash_id);
+            SketchStoreFileHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, SKETCH_STORE_MAGIC, sizeof(header.magic));
+            header.version = SKETCH_STORE_VERSION;
+            header.b = b;
+            header.hash_id = hash_id;
+            header.n_levels = SKETCH_STORE_LEVELS;
+            header.capacity = SKETCH_STORE_INITIAL_RECORDS;
+            memcpy(header.level_seconds, level_seconds, sizeof(level_seconds));
+            if (pwrite(this->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+                throw_errno("cannot initialize " + path);
+            }
+        }
+        SketchStoreFileHeader header;
+        if (pread(this->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+                memcmp(header.magic, SKETCH_STORE_MAGIC, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("sketch store: " + path + " is not a sketch store");
+        }
+        if (header.version != SKETCH_STORE_VERSION || header.n_levels != SKETCH_STORE_LEVELS ||
+                memcmp(header.level_seconds, level_seconds, sizeof(level_seconds)) != 0) {
+            throw std::runtime_error("sketch store: " + path + " has an unsupported layout");
+        }
+        // everything below sizes records from the header, so a damaged one must not get further
+        if (header.b < 4 || header.b > 20 || header.n_records > header.capacity) {
+            throw std::runtime_error("sketch store: " + path + " has a corrupt header");
+        }
+        get_hash_function(header.hash_id);
+        this->record_size = sizeof(SketchStoreRecord) + HyperLogLogOwnArrayCounter::storage_capacity(header.b);
+        // keep every region 8-byte aligned for exact hash tables
+        this->record_size = (this->record_size + 7) & ~(size_t)7;
+        this->map_file(sizeof(SketchStoreFileHeader) + header.capacity * this->record_size);
+
+        for (uint64_t i = 0; i < this->header->n_records; i++) {
+            SketchStoreRecord *r = this->record(i);
+            BucketId id;
+            id.key = std::string(r->key, strnlen(r->key, SKETCH_STORE_KEY_MAX));
+            id.level = r->level;
+            id.start = r->start;
+            this->index[id] = i;
+        }
+    } catch (...) {
+        this->unmap_file();
+        close(this->fd);
+        throw;
+    }
+}
+
+SketchStore::~SketchStore() {
+    this->unmap_file();
+    close(this->fd);
+}
+
+void SketchStore::map_file(size_t size) {
+    this->unmap_file();
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        throw_errno("cannot stat store");
+    }
+    if ((size_t)st.st_size < size && ftruncate(this->fd, size) != 0) {
+        throw_errno("cannot grow store");
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (p == MAP_FAILED) {
+        throw_errno("cannot map store");
+    }
+    this->data = (char *)p;
+    this->mapped_size = size;
+    this->header = (SketchStoreFileHeader *)this->data;
+}
+
+void SketchStore::unmap_file() {
+    if (this->data) {
+        munmap(this->data, this->mapped_size);
+        this->data = NULL;
+        this->header = NULL;
+        this->mapped_size = 0;
+    }
+}
+
+SketchStoreRecord *SketchStore::record(uint64_t i) {
+    return (SketchStoreRecord *)(this->data + sizeof(SketchStoreFileHeader) + i * this->record_size);
+}
+
+char *SketchStore::record_storage(uint64_t i) {
+    return (char *)(this->record(i) + 1);
+}
+
+int SketchStore::b() {
+    return this->header->b;
+}
+
+uint64_t SketchStore::n_records() {
+    return this->header->n_records;
+}
+
+int64_t SketchStore::find_record(const std::string &key, int level, int64_t start, bool create) {
+    BucketId id;
+    id.key = key;
+    id.level = level;
+    id.start = start;
+    std::map<BucketId, uint64_t>::const_iterator it = this->index.find(id);
+    if (it != this->index.end()) {
+        return it->second;
+    }
+    if (!create) {
+        return -1;
+    }
+    uint64_t i = this->header->n_records;
+    if (i == this->header->capacity) {
+        uint64_t capacity = this->header->capacity * 2;
+        this->map_file(sizeof(SketchStoreFileHeader) + capacity * this->record_size);
+        this->header->capacity = capacity;
+    }
+    SketchStoreRecord *r = this->record(i);
+    memset(r, 0, sizeof(*r));
+    memcpy(r->key, key.data(), key.size());
+    r->start = start;
+    r->level = level;
+    HyperLogLogOwnArrayCounter::init_storage(this->header->b, this->record_storage(i), this->header->hash_id);
+    this->header->n_records = i + 1;
+    this->index[id] = i;
+    return i;
+}
+
+void SketchStore::add(const std::string &key, int64_t timestamp, const char *value, int len) {
+    if (key.size() > SKETCH_STORE_KEY_MAX) {
+        throw std::runtime_error("sketch store: key is too long");
+    }
+    // keys are stored NUL-padded, so an embedded NUL would come back as a shorter key on reopen
+    if (key.find('\0') != std::string::npos) {
+        throw std::runtime_error("sketch store: keys must not contain NUL bytes");
+    }
+    if (timestamp < 0) {
+        throw std::runtime_error("sketch store: timestamps before the epoch are not supported");
+    }
+    for (int level = 0; level < SKETCH_STORE_LEVELS; level++) {
+        int64_t start = timestamp - timestamp % level_seconds[level];
+        int64_t i = this->find_record(key, level, start, true);
+        HyperLogLogOwnArrayCounter counter(this->header->b, this->record_storage(i));
+        counter.increment(value, len);
+    }
+}
+
+HyperLogLogOwnArrayCounter *SketchStore::range_union(const std::string &key, int64_t from, int64_t to, int *n_merges) {
+    const int64_t minute = level_seconds[0];
+    from = (from < 0) ? 0 : from - from % minute;
+    to = (to <= 0) ? 0 : to + (minute - to % minute) % minute;
+
+    HyperLogLogOwnArrayCounter *result = new HyperLogLogOwnArrayCounter(this->header->b, NULL, this->header->hash_id);
+    int merges = 0;
+    try {
+        int64_t t = from;
+        while (t < to) {
+            // the largest bucket starting at t that does not reach past the range
+            int level = SKETCH_STORE_LEVELS - 1;
+            while (level > 0 && (t % level_seconds[level] != 0 || t + level_seconds[level] > to)) {
+                level--;
+            }
+            int64_t i = this->find_record(key, level, t, false);
+            if (i >= 0) {
+                result->merge_from(HyperLogLogView(this->record_storage(i),
+                                                   this->record_size - sizeof(SketchStoreRecord)));
+                merges++;
+            }
+            t += level_seconds[level];
+        }
+    } catch (...) {
+        delete result;
+        throw;
+    }
+    if (n_merges) {
+        *n_merges = merges;
+    }
+    return result;
+}
+
+int SketchStore::count(const std::string &key, int64_t from, int64_t to, int *n_merges) {
+    HyperLogLogOwnArrayCounter *counter = this->range_union(key, from, to, n_merges);
+    int count = counter->count();
+    delete counter;
+    return count;
+}
+
+void SketchStore::flush() {
+    if (msync(this->data, this->mapped_size, MS_SYNC) != 0) {
+        throw_errno("cannot flush store");
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef _SKETCH_STORE_H
+#define _SKETCH_STORE_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include "CardinalityEstimators.h"
+
+/*
+ * Time-bucketed store of HyperLogLog sketches in a memory-mapped file.
+ *
+ * Every (key, time bucket) pair owns one HyperLogLogOwnArrayCounter storage
+ * region inside the file, updated in place. Each value is added to the
+ * bucket containing its timestamp at every rollup level (minute, hour, day,
+ * then 4, 16, 64 and 256 days, all aligned to the Unix epoch), so a distinct
+ * count over any time range is a union of a few pre-merged sketches: the
+ * range is covered greedily by the largest buckets that fit, which takes at
+ * most (ratio - 1) buckets of each level on either side.
+ *
+ * Regions are reserved at full dense size, but the file is grown with
+ * ftruncate(), so pages of small (exact or sparse) sketches that are never
+ * touched stay holes on disk.
+ *
+ * Not thread-safe; a file must be opened by one SketchStore at a time.
+ * Errors are reported with std::runtime_error.
+ */
+
+#define SKETCH_STORE_KEY_MAX 32
+#define SKETCH_STORE_LEVELS 7
+
+struct SketchStoreFileHeader;
+struct SketchStoreRecord;
+
+class SketchStore {
+    protected:
+        struct BucketId {
+            std::string key;
+            int level;
+            int64_t start;
+            bool operator<(const BucketId &other) const;
+        };
+        int fd;
+        char *data;
+        size_t mapped_size;
+        SketchStoreFileHeader *header;
+        size_t record_size;
+        std::map<BucketId, uint64_t> index;
+        void map_file(size_t size);
+        void unmap_file();
+        SketchStoreRecord *record(uint64_t i);
+        char *record_storage(uint64_t i);
+        /* index of the record for the bucket, appending an empty one if create is set; -1 if missing */
+        int64_t find_record(const std::string &key, int level, int64_t start, bool create);
+    public:
+        /* seconds covered by a bucket of each level, coarser levels are multiples of finer ones */
+        static const int64_t level_seconds[SKETCH_STORE_LEVELS];
+        /* Opens the store at path, creating it with precision b and the given hash family if it
+         * does not exist; an existing store keeps the parameters it was created with */
+        SketchStore(const std::string &path, int b=12, int hash_id=HASH_DEFAULT);
+        ~SketchStore();
+        int b();
+        uint64_t n_records();
+        /* Adds value to key's buckets around timestamp (seconds since the epoch, not negative);
+         * keys are at most SKETCH_STORE_KEY_MAX bytes and must not contain NUL bytes */
+        void add(const std::string &key, int64_t timestamp, const char *value, int len=-1);
+        /* Union of key's sketches over [from, to), widened to whole minutes; the caller owns the result.
+         * n_merges, if given, receives the number of stored sketches merged */
+        HyperLogLogOwnArrayCounter *range_union(const std::string &key, int64_t from, int64_t to, int *n_merges=NULL);
+        /* Distinct values of key over [from, to), widened to whole minutes */
+        int count(const std::string &key, int64_t from, int64_t to, int *n_merges=NULL);
+        /* Writes dirty pages back to the file */
+        void flush();
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/time.h>
+#include "SketchStore.h"
+
+/*
+ * Command line front end of SketchStore:
+ *
+ *   sketch_store FILE add KEY [PRECISION]  reads "TIMESTAMP VALUE" lines from stdin
+ *   sketch_store FILE count KEY FROM TO     distinct values of KEY over [FROM, TO)
+ *   sketch_store FILE info                  store parameters
+ *
+ * Timestamps are seconds since the epoch.
+ */
+
+static int usage() {
+    fprintf(stderr, "usage: sketch_store FILE add KEY [PRECISION] < events\n"
+                    "       sketch_store FILE count KEY FROM TO\n"
+                    "       sketch_store FILE info\n");
+    return 2;
+}
+
+static int add(const char *path, const char *key, int b) {
+    SketchStore store(path, b);
+    char line[4096];
+    long n_events = 0;
+    while (fgets(line, sizeof(line), stdin)) {
+        char *value;
+        long long timestamp = strtoll(line, &value, 10);
+        if (value == line || (*value != ' ' && *value != '\t')) {
+            fprintf(stderr, "skipping malformed line %ld\n", n_events + 1);
+            continue;
+        }
+        value++;
+        size_t len = strcspn(value, "\r\n");
+        store.add(key, timestamp, value, len);
+        n_events++;
+    }
+    store.flush();
+    printf("added %ld events, %llu buckets in store\n", n_events, (unsigned long long)store.n_records());
+    return 0;
+}
+
+static int count(const char *path, const char *key, long long from, long long to) {
+    SketchStore store(path);
+    struct timeval t0, t1;
+    int n_merges;
+    gettimeofday(&t0, NULL);
+    int count = store.count(key, from, to, &n_merges);
+    gettimeofday(&t1, NULL);
+    double dt = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec);
+    printf("%d\t(%d sketches merged in %.0f us)\n", count, n_merges, dt);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        return usage();
+    }
+    try {
+        if (strcmp(argv[2], "add") == 0 && (argc == 4 || argc == 5)) {
+            return add(argv[1], argv[3], (argc == 5) ? atoi(argv[4]) : 12);
+        }
+        if (strcmp(argv[2], "count") == 0 && argc == 6) {
+            return count(argv[1], argv[3], atoll(argv[4]), atoll(argv[5]));
+        }
+        if (strcmp(argv[2], "info") == 0 && argc == 3) {
+            SketchStore store(argv[1]);
+            printf("precision %d, %llu buckets\n", store.b(), (unsigned long long)store.n_records());
+            return 0;
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return usage();
+}
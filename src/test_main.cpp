@@ -1,9 +1,17 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
 #include <sys/time.h>
 #include "CardinalityEstimators.h"
+#include "SketchStore.h"
 #include "Serializer.h"
+#include "HashFunctions.h"
+#include "MurmurHash3.h"
+#include "RegisterKernels.h"
 
 void serializer_test() {
     Serializer ser;
@@ -34,6 +42,36 @@ void serializer_test() {
     ser.free_containers();
 }
 
+/* A span larger than any container must come back intact, and borrow() must only hand out whole ranges */
+void serializer_span_test() {
+    Serializer ser;
+    ser.add_storage(new char[1000], 1000);
+    ser.add_storage(new char[777], 777);
+    ser.add_storage(new char[5000], 5000);
+
+    std::vector<char> data(6000);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (char)(i * 31 + 7);
+    }
+    ser.write_int(42);
+    ser.write_span(&data[0], data.size());
+    size_t used = ser.size();
+    size_t used0 = ser.container_used(0), used1 = ser.container_used(1), used2 = ser.container_used(2);
+
+    ser.reset();
+    std::vector<char> back(data.size());
+    int x = ser.read_int();
+    ser.read_span(&back[0], back.size());
+
+    ser.reset();
+    const char *in_place = ser.borrow(sizeof(int));
+    const char *straddling = ser.borrow(1000);
+    printf("Serializer spans: %lu bytes over 3 containers (%lu + %lu + %lu), intact: %s, borrowed in place: %s, straddling range borrowed: %s\n",
+           used, used0, used1, used2,
+           (x == 42 && back == data) ? "yes" : "no", in_place ? "yes" : "no", straddling ? "yes" : "no");
+    ser.free_containers();
+}
+
 void merging_test(ICardinalityEstimator *base_counter) {
     int n_elements = 1000000;
     char buf[50];
@@ -85,6 +123,535 @@ void merging_test(ICardinalityEstimator *base_counter) {
 }
 
 
+/* A storage region is a stored sketch: it must survive a byte copy and be rejected when cut short */
+void storage_test() {
+    char buf[50];
+    int i;
+    HyperLogLogOwnArrayCounter counter(12, NULL);
+    for (i = 0; i < 100000; i++) {
+        sprintf(buf, "%u", i);
+        counter.increment(buf);
+    }
+    // build the sketch in an external region, as the UDx does
+    std::vector<char> region(HyperLogLogOwnArrayCounter::storage_capacity(12));
+    HyperLogLogOwnArrayCounter::init_storage(12, &region[0]);
+    HyperLogLogOwnArrayCounter built(12, &region[0]);
+    built.merge_from(&counter);
+    size_t used = built.storage_used();
+
+    std::vector<char> copied(region.begin(), region.begin() + used);
+    sketch_seal((SketchHeader *)&copied[0]);
+    HyperLogLogView stored(&copied[0], used);
+    bool rejected = false;
+    try {
+        HyperLogLogView truncated(&copied[0], used - 1);
+    } catch (std::runtime_error &e) {
+        rejected = true;
+    }
+    printf("%s:\tstored count = %d, original count = %d, truncated sketch rejected: %s\n",
+           built.repr().c_str(), stored.count(), counter.count(), rejected ? "yes" : "no");
+}
+
+/* Updates a region in blocks through short-lived counters, as the UDx does with its intermediates,
+ * merges a second region into it in place and reads the result through View. Nothing a counter
+ * has seen may be lost when it is destroyed without a storage_used() call */
+template<class Counter, class View>
+void in_place_test(int param) {
+    char buf[50];
+    int i, block;
+    Counter all(param, NULL);
+    std::vector<char> left(Counter::storage_capacity(param)), right(Counter::storage_capacity(param));
+    Counter::init_storage(param, &left[0]);
+    Counter::init_storage(param, &right[0]);
+    size_t left_used = 0, right_used = 0;
+    for (block = 0; block < 10; block++) {
+        Counter counter(param, (block % 2) ? &right[0] : &left[0]);
+        for (i = block * 20000; i < (block + 1) * 20000; i++) {
+            sprintf(buf, "%u", i);
+            counter.increment(buf);
+            all.increment(buf);
+        }
+        // the last two blocks leave the region to the destructor
+        if (block < 8) {
+            ((block % 2) ? right_used : left_used) = counter.storage_used();
+        }
+    }
+    right_used = sketch_size((const SketchHeader *)&right[0]);
+    Counter merged(param, &left[0]);
+    merged.merge_from(View(&right[0], right_used));
+    left_used = merged.storage_used();
+    std::string repr = merged.repr();
+
+    View view(&left[0], left_used);
+    printf("%s:\tin place count = %d, count = %d, %lu of %lu bytes used%s\n", repr.c_str(), view.count(),
+           all.count(), left_used, left.size(), (view.count() == all.count()) ? "" : " MISMATCH");
+}
+
+/* Packing must shrink a dense sketch without changing what it counts */
+void packing_test(int b, int n_elements) {
+    char buf[50];
+    int i;
+    HyperLogLogOwnArrayCounter counter(b, NULL);
+    for (i = 0; i < n_elements; i++) {
+        sprintf(buf, "%u", i);
+        counter.increment(buf);
+    }
+    size_t dense_size = counter.storage_used();
+    int dense_count = counter.count();
+    counter.pack();
+    std::string packed_repr = counter.repr();
+
+    HyperLogLogOwnArrayCounter merged(b, NULL);
+    merged.merge_from(&counter);
+    int packed_count = counter.count();
+    counter.increment("one more");
+    printf("%s:\tdense %lu bytes, count = %d; packed count = %d, merged count = %d, updated after packing: %s\n",
+           packed_repr.c_str(), dense_size, dense_count, packed_count, merged.count(), counter.repr().c_str());
+}
+
+/* Small sets must be counted exactly, and merges of exact and register sketches must agree with one sketch of everything */
+void exact_test(int b) {
+    char buf[50];
+    int i;
+    int sizes[] = {1, 100, 700, 3000, 100000};
+    for (int a = 0; a < 5; a++) {
+        for (int c = 0; c < 5; c++) {
+            HyperLogLogOwnArrayCounter left(b, NULL), right(b, NULL), all(b, NULL);
+            for (i = 0; i < sizes[a]; i++) {
+                sprintf(buf, "%u", i);
+                left.increment(buf);
+                all.increment(buf);
+            }
+            // half of the right side overlaps the left one
+            for (i = sizes[a] / 2; i < sizes[a] / 2 + sizes[c]; i++) {
+                sprintf(buf, "%u", i);
+                right.increment(buf);
+                all.increment(buf);
+            }
+            std::string left_repr = left.repr(), right_repr = right.repr();
+            int left_count = left.count();
+            left.merge_from(&right);
+            printf("%s (count %d) + %s:\tmerged count = %d, count of all = %d%s\n", left_repr.c_str(), left_count,
+                   right_repr.c_str(), left.count(), all.count(), (left.count() == all.count()) ? "" : " MISMATCH");
+        }
+    }
+}
+
+/* A sketch of precision high_b folded into an empty one of precision b must count the
+ * same as a sketch built at precision b, whatever encoding the high precision one is in */
+void fold_test(int b, int high_b) {
+    char buf[50];
+    int sizes[] = {1, 100, 700, 3000, 100000};
+    for (int a = 0; a < 5; a++) {
+        for (int packed = 0; packed < 2; packed++) {
+            HyperLogLogOwnArrayCounter high(high_b, NULL), low(b, NULL), folded(b, NULL);
+            for (int i = 0; i < sizes[a]; i++) {
+                sprintf(buf, "%u", i);
+                high.increment(buf);
+                low.increment(buf);
+            }
+            if (packed) {
+                high.pack();
+            }
+            std::vector<char> data(HyperLogLogOwnArrayCounter::storage_capacity(high_b));
+            Serializer ser;
+            ser.add_storage(&data[0], data.size());
+            high.serialize(&ser);
+            folded.merge_from(HyperLogLogView(&data[0], ser.size()));
+            printf("%s folded to b=%d:\tcount = %d, built at b=%d: %d%s\n", high.repr().c_str(), b,
+                   folded.count(), b, low.count(), (folded.count() == low.count()) ? "" : " MISMATCH");
+        }
+    }
+    HyperLogLogOwnArrayCounter high(high_b, NULL), low(b, NULL);
+    std::vector<char> data(HyperLogLogOwnArrayCounter::storage_capacity(b));
+    Serializer ser;
+    ser.add_storage(&data[0], data.size());
+    low.serialize(&ser);
+    bool rejected = false;
+    try {
+        high.merge_from(HyperLogLogView(&data[0], ser.size()));
+    } catch (std::runtime_error &e) {
+        rejected = true;
+    }
+    printf("HyperLogLog b=%d into b=%d:\t%s%s\n", b, high_b, rejected ? "rejected" : "accepted", rejected ? "" : " MISMATCH");
+}
+
+/* Reads a sketch serialized into one buffer through View, then flips a payload byte */
+template<class Counter, class View>
+void view_test(Counter *counter) {
+    char buf[50];
+    int i;
+    for (i = 0; i < 100000; i++) {
+        sprintf(buf, "%u", i);
+        counter->increment(buf);
+    }
+    std::vector<char> data(4 * 1024 * 1024);
+    Serializer ser;
+    ser.add_storage(&data[0], data.size());
+    counter->serialize(&ser);
+    size_t len = ser.size();
+
+    View view(&data[0], len);
+    int view_count = view.count();
+    Counter *merged = (Counter *)counter->clone();
+    merged->merge_from(view);
+
+    data[sizeof(SketchHeader) + 1] ^= 1;
+    bool rejected = false;
+    try {
+        View damaged(&data[0], len);
+    } catch (std::runtime_error &e) {
+        rejected = true;
+    }
+    printf("%s:\tview count = %d, count = %d, merged into empty = %d, damaged sketch rejected: %s\n",
+           counter->repr().c_str(), view_count, counter->count(), merged->count(), rejected ? "yes" : "no");
+    delete merged;
+    delete counter;
+}
+
+/* KMV sketch of the values [from, to) serialized into data */
+static KMinValuesView kmv_range_sketch(int k, int from, int to, std::vector<char> &data) {
+    KMinValuesCounter counter(k);
+    char buf[50];
+    for (int i = from; i < to; i++) {
+        sprintf(buf, "%u", i);
+        counter.increment(buf);
+    }
+    data.resize(KMinValuesOverlap::serialized_size(k));
+    Serializer ser;
+    ser.add_storage(&data[0], data.size());
+    counter.serialize(&ser);
+    return KMinValuesView(&data[0], ser.size());
+}
+
+/* Union, intersection and Jaccard index of overlapping ranges against the exact ones */
+void overlap_test(int k) {
+    std::vector<char> a_data, b_data, c_data, state_data;
+    // |A| = 300K, |B| = 200K, |A n B| = 100K; C covers a third of the intersection
+    KMinValuesView a = kmv_range_sketch(k, 0, 300000, a_data);
+    KMinValuesView b = kmv_range_sketch(k, 200000, 400000, b_data);
+    KMinValuesView c = kmv_range_sketch(k, 250000, 1000000, c_data);
+
+    KMinValuesOverlap ab(k);
+    ab.add(a);
+    ab.add(b);
+    printf("KMinValuesOverlap(k=%d) A, B:\tunion = %d (exact 400000), intersection = %d (exact 100000), jaccard = %.4f (exact 0.2500)\n",
+           k, ab.union_count(), ab.intersection_count(), ab.jaccard());
+
+    // the state survives a round trip and combines with the overlap of the rest
+    Serializer ser;
+    state_data.resize(KMinValuesOverlap::serialized_size(k));
+    ser.add_storage(&state_data[0], state_data.size());
+    ab.serialize(&ser);
+    Serializer reader;
+    reader.add_storage(&state_data[0], ser.size());
+    KMinValuesOverlap abc(k);
+    abc.unserialize(&reader);
+    KMinValuesOverlap rest(k);
+    rest.add(c);
+    abc.merge_from(rest);
+    printf("KMinValuesOverlap(k=%d) A, B, C:\tunion = %d (exact 1000000), intersection = %d (exact 50000), jaccard = %.4f (exact 0.0500), %d sketches\n",
+           k, abc.union_count(), abc.intersection_count(), abc.jaccard(), abc.sketches());
+
+    // small sets are known exactly
+    KMinValuesOverlap small(k);
+    small.add(kmv_range_sketch(k, 0, 1000, a_data));
+    small.add(kmv_range_sketch(k, 600, 1500, b_data));
+    printf("KMinValuesOverlap(k=%d) small:\tunion = %d (exact 1500), intersection = %d (exact 400)\n",
+           k, small.union_count(), small.intersection_count());
+}
+
+/* Hashes computed upstream go straight into the sketch: same registers as hashing
+ * here, and sequential ids need the finaliser */
+void prehashed_test(int b) {
+    const int n_elements = 1000000;
+    const int batch_size = 1024;
+    const HashFunction *upstream = get_hash_function(HASH_WYHASH);
+    std::vector<uint64_t> hashes(n_elements), ids(n_elements);
+    char buf[50];
+    struct timeval t0, t1;
+
+    HyperLogLogOwnArrayCounter hashed_here(b, NULL, HASH_WYHASH);
+    for (int i = 0; i < n_elements; i++) {
+        int len = sprintf(buf, "%u", i);
+        hashes[i] = upstream->hash(buf, len);
+        ids[i] = i;
+        hashed_here.increment(buf, len);
+    }
+
+    HyperLogLogOwnArrayCounter prehashed(b, NULL, HASH_PREHASHED);
+    gettimeofday(&t0, NULL);
+    for (int i = 0; i < n_elements; i += batch_size) {
+        prehashed.increment_int_batch(&hashes[i], std::min(batch_size, n_elements - i));
+    }
+    gettimeofday(&t1, NULL);
+    double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+    HyperLogLogOwnArrayCounter direct(b, NULL, HASH_PREHASHED);
+    for (int i = 0; i < n_elements; i++) {
+        direct.increment_hash(hashes[i]);
+    }
+
+    HyperLogLogOwnArrayCounter raw_ids(b, NULL, HASH_PREHASHED), mixed_ids(b, NULL, HASH_PREHASHED_FMIX);
+    raw_ids.increment_int_batch(&ids[0], n_elements);
+    mixed_ids.increment_int_batch(&ids[0], n_elements);
+
+    bool rejected = false;
+    try {
+        hashed_here.merge_from(&prehashed);
+    } catch (std::runtime_error &e) {
+        rejected = true;
+    }
+    printf("%s:\tprehashed count = %d (%.2f ns/value), increment_hash count = %d, hashed here = %d, "
+           "sequential ids raw = %d, with fmix = %d, merge with wyhash sketch rejected: %s\n",
+           prehashed.repr().c_str(), prehashed.count(), dt * 1e9 / n_elements, direct.count(), hashed_here.count(),
+           raw_ids.count(), mixed_ids.count(), rejected ? "yes" : "no");
+}
+
+/* Sorted input: runs of equal values must count like the distinct values fed once */
+void runs_test(int b) {
+    const int n_rows = 4000000;
+    const int batch_size = 1024;
+    const int run_lengths[] = {1, 3, 10, 1000};
+    struct timeval t0, t1;
+
+    for (size_t r = 0; r < sizeof(run_lengths) / sizeof(run_lengths[0]); r++) {
+        int run = run_lengths[r];
+        int n_distinct = (n_rows + run - 1) / run;
+        std::vector<char> data(n_distinct * 16);
+        std::vector<const char *> keys(n_rows);
+        std::vector<int> lengths(n_rows);
+        std::vector<uint64_t> values(n_rows);
+        HyperLogLogOwnArrayCounter once(b, NULL), once_int(b, NULL);
+        for (int i = 0; i < n_distinct; i++) {
+            int len = sprintf(&data[i * 16], "%u", i);
+            once.increment(&data[i * 16], len);
+            uint64_t value = i;
+            once_int.increment_int_batch(&value, 1);
+        }
+        for (int i = 0; i < n_rows; i++) {
+            // every other run repeats the same pointer, the rest are equal copies
+            int d = i / run;
+            keys[i] = &data[d * 16];
+            lengths[i] = strlen(keys[i]);
+            values[i] = d;
+        }
+        std::vector<char> copies(n_rows * 16);
+        for (int i = 0; i < n_rows; i++) {
+            if ((i / run) % 2) {
+                memcpy(&copies[i * 16], keys[i], lengths[i]);
+                keys[i] = &copies[i * 16];
+            }
+        }
+
+        HyperLogLogOwnArrayCounter strings(b, NULL), ints(b, NULL);
+        gettimeofday(&t0, NULL);
+        for (int i = 0; i < n_rows; i += batch_size) {
+            strings.increment_batch(&keys[i], &lengths[i], std::min(batch_size, n_rows - i));
+        }
+        gettimeofday(&t1, NULL);
+        double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        gettimeofday(&t0, NULL);
+        for (int i = 0; i < n_rows; i += batch_size) {
+            ints.increment_int_batch(&values[i], std::min(batch_size, n_rows - i));
+        }
+        gettimeofday(&t1, NULL);
+        double dt_int = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+        printf("%s:\truns of %d:\tstrings count = %d (fed once = %d, %.2f ns/row), "
+               "ints count = %d (fed once = %d, %.2f ns/row)\n",
+               strings.repr().c_str(), run, strings.count(), once.count(), dt * 1e9 / n_rows,
+               ints.count(), once_int.count(), dt_int * 1e9 / n_rows);
+    }
+}
+
+/* A hash memo must not change the sketch, and must turn itself off for high-cardinality input */
+void hash_memo_test(int n_distinct) {
+    const int n_rows = 4000000;
+    const int batch_size = 1024;
+    struct timeval t0, t1;
+
+    // up to 51 bytes, so a few keys are too long to be memoized
+    std::vector<std::string> dictionary(std::min(n_distinct, n_rows));
+    for (size_t d = 0; d < dictionary.size(); d++) {
+        char buf[80];
+        sprintf(buf, "%u-%.*s", (unsigned)d, (int)(d * 7 % 48), "campaign-spring-sale-newsletter-retargeting-mobile-web-test");
+        dictionary[d] = buf;
+    }
+    std::vector<const char *> keys(n_rows);
+    std::vector<int> lengths(n_rows);
+    srand(42);
+    for (int i = 0; i < n_rows; i++) {
+        const std::string &key = dictionary[(n_distinct >= n_rows) ? i : rand() % n_distinct];
+        keys[i] = key.data();
+        lengths[i] = key.size();
+    }
+
+    double dt[2];
+    int counts[2];
+    HashMemo memo(HASH_MURMUR3);
+    for (int with_memo = 0; with_memo < 2; with_memo++) {
+        LinearProbabilisticCounter counter(1 << 24, HASH_MURMUR3);
+        if (with_memo) {
+            counter.set_hash_memo(&memo);
+        }
+        gettimeofday(&t0, NULL);
+        for (int i = 0; i < n_rows; i += batch_size) {
+            counter.increment_batch(&keys[i], &lengths[i], std::min(batch_size, n_rows - i));
+        }
+        gettimeofday(&t1, NULL);
+        dt[with_memo] = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+        counts[with_memo] = counter.count();
+    }
+    printf("HashMemo(murmur3):\t%d distinct strings:\tcount = %d without memo (%.2f ns/row), %d with (%.2f ns/row), "
+           "memo still enabled: %s\n", (int)dictionary.size(), counts[0], dt[0] * 1e9 / n_rows,
+           counts[1], dt[1] * 1e9 / n_rows, memo.is_enabled() ? "yes" : "no");
+}
+
+/* Repeating every value must not change the estimate */
+void duplicates_test(ICardinalityEstimator *counter) {
+    int n_distinct = 100000;
+    int n_repeats = 10;
+    char buf[50];
+    int i, r;
+
+    for (r = 0; r < n_repeats; r++) {
+        for (i = 0; i < n_distinct; i++) {
+            sprintf(buf, "%u", i);
+            counter->increment(buf);
+        }
+    }
+    int count = counter->count();
+    double err_percent = 100.0 * abs(double(count) - n_distinct) / double(n_distinct);
+    printf("%s:\t%d values x %d:\tcount = %d (error = %.2f%%)\n", counter->repr().c_str(),
+           n_distinct, n_repeats, count, err_percent);
+    delete counter;
+}
+
+/* Mean and RMS relative error over independent runs, through the small-count
+ * and transition ranges where HyperLogLog estimators tend to be biased */
+void bias_test(int b) {
+    int sizes[] = {100, 1000, 2500, 5000, 10000, 20000, 50000, 200000};
+    int n_runs = 20;
+    char buf[50];
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n_elements = sizes[s];
+        double sum_err = 0, sum_sq_err = 0;
+        for (int r = 0; r < n_runs; r++) {
+            HyperLogLogCounter counter(b);
+            for (int i = 0; i < n_elements; i++) {
+                sprintf(buf, "%d:%d", r, i);
+                counter.increment(buf);
+            }
+            double err = (double(counter.count()) - n_elements) / n_elements;
+            sum_err += err;
+            sum_sq_err += err * err;
+        }
+        printf("HLL b=%d, %d values x %d runs:\tbias = %+.2f%%, rmse = %.2f%%\n", b, n_elements, n_runs,
+               100.0 * sum_err / n_runs, 100.0 * sqrt(sum_sq_err / n_runs));
+    }
+}
+
+/* Synthetic event stream over 30 days with a drifting user population, then
+ * range unions of growing length against exact counts */
+void sketch_store_test(int b) {
+    const char *path = "/tmp/test_main_sketch_store";
+    const int64_t base = 1700000000;
+    const int64_t span = 30 * 86400;
+    const int n_events = 1000000;
+    std::vector<int64_t> times(n_events);
+    std::vector<int> users(n_events);
+    char buf[50];
+    struct timeval t0, t1;
+
+    unlink(path);
+    srand(42);
+    SketchStore *store = new SketchStore(path, b);
+    gettimeofday(&t0, NULL);
+    for (int i = 0; i < n_events; i++) {
+        times[i] = base + span * (int64_t)i / n_events;
+        // about 3000 new users a day, on top of a pool of 20000 regulars
+        users[i] = (rand() % 4 == 0) ? rand() % 20000 : 20000 + (times[i] - base) / 86400 * 3000 + rand() % 3000;
+        sprintf(buf, "%d", users[i]);
+        store->add("site", times[i], buf);
+    }
+    gettimeofday(&t1, NULL);
+    double dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+    printf("SketchStore(b=%d):\t%d events in %.3fs (%.0f ns/event), %llu buckets\n", b, n_events, dt,
+           dt * 1e9 / n_events, (unsigned long long)store->n_records());
+
+    int64_t lengths[] = {600, 3600, 6 * 3600, 86400, 7 * 86400, 29 * 86400};
+    // not aligned to any bucket; ranges are widened to whole minutes on both ends
+    int64_t from = base + 17 * 60 + 25;
+    std::vector<char> seen(20000 + 31 * 3000);
+    int day_count = 0;
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        int64_t to = from + lengths[l];
+        int64_t exact_from = from - from % 60, exact_to = to + (60 - to % 60) % 60;
+        std::fill(seen.begin(), seen.end(), 0);
+        int exact = 0;
+        for (int i = 0; i < n_events; i++) {
+            if (times[i] >= exact_from && times[i] < exact_to && !seen[users[i]]) {
+                seen[users[i]] = 1;
+                exact++;
+            }
+        }
+        int n_queries = 100, n_merges = 0, count = 0;
+        gettimeofday(&t0, NULL);
+        for (int q = 0; q < n_queries; q++) {
+            count = store->count("site", from, to, &n_merges);
+        }
+        gettimeofday(&t1, NULL);
+        double us = ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec)) / n_queries;
+        if (lengths[l] == 86400) {
+            day_count = count;
+        }
+        printf("SketchStore(b=%d) range of %7llds:\t%2d sketches merged, %8.1f us/query, count = %d, exact = %d (error = %.2f%%)\n",
+               b, (long long)lengths[l], n_merges, us, count, exact, 100.0 * fabs(double(count) - exact) / exact);
+    }
+    delete store;
+
+    store = new SketchStore(path);
+    int reopened_count = store->count("site", from, from + 86400);
+    printf("SketchStore(b=%d) reopened:\t%llu buckets, day count = %d (%s)\n", store->b(),
+           (unsigned long long)store->n_records(), reopened_count, (reopened_count == day_count) ? "same" : "DIFFERENT");
+    bool nul_rejected = false;
+    try {
+        store->add(std::string("si\0te", 5), base, "1");
+    } catch (std::runtime_error &e) {
+        nul_rejected = true;
+    }
+    delete store;
+
+    // a precision out of range and an unknown hash family in the file header
+    const long header_offsets[] = { 12, 16 };
+    const uint32_t bad_values[] = { 31, 99 };
+    int corrupt_rejected = 0;
+    for (int c = 0; c < 2; c++) {
+        uint32_t saved;
+        FILE *f = fopen(path, "r+b");
+        fseek(f, header_offsets[c], SEEK_SET);
+        fread(&saved, sizeof(saved), 1, f);
+        fseek(f, header_offsets[c], SEEK_SET);
+        fwrite(&bad_values[c], sizeof(bad_values[c]), 1, f);
+        fclose(f);
+        try {
+            delete new SketchStore(path);
+        } catch (std::runtime_error &e) {
+            corrupt_rejected++;
+        }
+        f = fopen(path, "r+b");
+        fseek(f, header_offsets[c], SEEK_SET);
+        fwrite(&saved, sizeof(saved), 1, f);
+        fclose(f);
+    }
+    printf("SketchStore(b=%d) bad input:\tNUL in key %s, %d of 2 corrupt headers rejected%s\n", b,
+           nul_rejected ? "rejected" : "accepted", corrupt_rejected,
+           (nul_rejected && corrupt_rejected == 2) ? "" : " MISMATCH");
+    unlink(path);
+}
+
 void benchmark() {
     int n_elements = 50000000;
     char buf[50];
@@ -96,7 +663,7 @@ void benchmark() {
     counters.push_back(new LinearProbabilisticCounter(128 * 1024 * 8));
     counters.push_back(new KMinValuesCounter(16 * 1024));
     counters.push_back(new HyperLogLogCounter(15));
-    counters.push_back(new HyperLogLogOwnArrayCounter(15, NULL, NULL));
+    counters.push_back(new HyperLogLogOwnArrayCounter(15, NULL));
     counters.push_back(new DummyCounter(0));
 
     printf("Testing with %d elements...\n", n_elements);
@@ -119,6 +686,286 @@ void benchmark() {
     }
 }
 
+void benchmark_batch() {
+    int n_elements = 50000000;
+    const int batch_size = 1024;
+    char buf[batch_size][50];
+    const char *keys[batch_size];
+    int lengths[batch_size];
+    int i, j;
+    struct timeval t0, t1;
+    double dt;
+    std::vector<ICardinalityEstimator*> counters;
+
+    counters.push_back(new LinearProbabilisticCounter(128 * 1024 * 8));
+    counters.push_back(new KMinValuesCounter(16 * 1024));
+    counters.push_back(new HyperLogLogCounter(15));
+    counters.push_back(new HyperLogLogOwnArrayCounter(15, NULL));
+    counters.push_back(new DummyCounter(0));
+
+    printf("Testing increment_batch with %d elements...\n", n_elements);
+
+    while (counters.size() > 0) {
+        ICardinalityEstimator *counter = counters.back();
+        gettimeofday(&t0, NULL);
+        for (i = 0; i < n_elements; i += batch_size) {
+            int n = (n_elements - i < batch_size) ? n_elements - i : batch_size;
+            for (j = 0; j < n; j++) {
+                lengths[j] = sprintf(buf[j], "%u", i + j);
+                keys[j] = buf[j];
+            }
+            counter->increment_batch(keys, lengths, n);
+        }
+        int count = counter->count();
+        gettimeofday(&t1, NULL);
+        dt = (t1.tv_sec - t0.tv_sec) + (double(t1.tv_usec - t0.tv_usec) / 1000000.0);
+        double err_percent = 100.0 * abs(double(count) - n_elements) / double(n_elements);
+        printf("%s:\tcount = %d (error = %.2f%%) time = %.3fs\n", counter->repr().c_str(), count, err_percent, dt);
+        delete counter;
+        counters.pop_back();
+    }
+}
+
+void benchmark_int_batch() {
+    int n_elements = 50000000;
+    const int batch_size = 1024;
+    uint64_t values[batch_size];
+    int i, j;
+    struct timeval t0, t1;
+    double dt;
+    std::vector<ICardinalityEstimator*> counters;
+
+    counters.push_back(new LinearProbabilisticCounter(128 * 1024 * 8));
+    counters.push_back(new KMinValuesCounter(16 * 1024));
+    counters.push_back(new HyperLogLogCounter(15));
+    counters.push_back(new HyperLogLogOwnArrayCounter(15, NULL));
+    counters.push_back(new DummyCounter(0));
+
+    printf("Testing increment_int_batch with %d elements...\n", n_elements);
+
+    while (counters.size() > 0) {
+        ICardinalityEstimator *counter = counters.back();
+        gettimeofday(&t0, NULL);
+        for (i = 0; i < n_elements; i += batch_size) {
+            int n = (n_elements - i < batch_size) ? n_elements - i : batch_size;
+            for (j = 0; j < n; j++) {
+                values[j] = i + j;
+            }
+            counter->increment_int_batch(values, n);
+        }
+        int count = counter->count();
+        gettimeofday(&t1, NULL);
+        dt = (t1.tv_sec - t0.tv_sec) + (double(t1.tv_usec - t0.tv_usec) / 1000000.0);
+        double err_percent = 100.0 * abs(double(count) - n_elements) / double(n_elements);
+        printf("%s:\tcount = %d (error = %.2f%%) time = %.3fs\n", counter->repr().c_str(), count, err_percent, dt);
+        delete counter;
+        counters.pop_back();
+    }
+}
+
+/* Ingest speed as the register array outgrows the caches, one key and one batch
+ * at a time; buffered and direct updates must end up with the same registers */
+void benchmark_precision() {
+    int n_elements = 10000000;
+    const int batch_size = 1024;
+    uint64_t values[batch_size];
+    struct timeval t0, t1;
+
+    for (int b = 12; b <= 20; b += 2) {
+        HyperLogLogCounter single(b), batched(b);
+        gettimeofday(&t0, NULL);
+        for (int i = 0; i < n_elements; i++) {
+            values[0] = i;
+            single.increment((const char *)&values[0], sizeof(uint64_t));
+        }
+        int single_count = single.count();
+        gettimeofday(&t1, NULL);
+        double dt_single = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+        gettimeofday(&t0, NULL);
+        for (int i = 0; i < n_elements; i += batch_size) {
+            for (int j = 0; j < batch_size; j++) {
+                values[j] = i + j;
+            }
+            batched.increment_int_batch(values, batch_size);
+        }
+        int batch_count = batched.count();
+        gettimeofday(&t1, NULL);
+        double dt_batch = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+
+        // same keys through the direct increment of the storage region counter
+        HyperLogLogOwnArrayCounter direct(b, NULL);
+        for (int i = 0; i < n_elements; i++) {
+            values[0] = i;
+            direct.increment((const char *)&values[0], sizeof(uint64_t));
+        }
+        printf("%s:\tincrement %.2f ns/key (count = %d, %s as direct updates), increment_int_batch %.2f ns/value (count = %d)\n",
+               single.repr().c_str(), dt_single * 1e9 / n_elements, single_count,
+               (single_count == direct.count()) ? "same" : "DIFFERENT",
+               dt_batch * 1e9 / n_elements, batch_count);
+    }
+}
+
+/* The dispatched register kernels (AVX2 where available) must match plain loops for every
+ * length, including the remainders past the last full vector, and for unaligned arrays */
+void register_kernels_test() {
+    const int max_len = 203;
+    int mismatches = 0;
+    srand(4242);
+    for (int n = 0; n <= max_len; n++) {
+        for (int offset = 0; offset < 3; offset++) {
+            // one spare element past the end: the kernels must leave it alone too
+            int size = n + offset + 1;
+            std::vector<uint8_t> u8_src(size), u8_dst(size), u8_ref;
+            std::vector<int> i32_src(size), i32_dst(size), i32_ref;
+            std::vector<uint64_t> u64_src(size), u64_dst(size), u64_ref;
+            for (int i = 0; i < size; i++) {
+                u8_src[i] = rand();
+                u8_dst[i] = rand();
+                i32_src[i] = rand() - RAND_MAX / 2;
+                i32_dst[i] = rand() - RAND_MAX / 2;
+                u64_src[i] = ((uint64_t)rand() << 33) ^ rand();
+                u64_dst[i] = ((uint64_t)rand() << 33) ^ rand();
+            }
+            u8_ref = u8_dst;
+            i32_ref = i32_dst;
+            u64_ref = u64_dst;
+            size_t popcount = 0;
+            for (int i = offset; i < n + offset; i++) {
+                u8_ref[i] = std::max(u8_ref[i], u8_src[i]);
+                i32_ref[i] = std::max(i32_ref[i], i32_src[i]);
+                u64_ref[i] |= u64_src[i];
+                popcount += __builtin_popcountll(u64_ref[i]);
+            }
+            registers_max_u8(&u8_dst[0] + offset, &u8_src[0] + offset, n);
+            registers_max_i32(&i32_dst[0] + offset, &i32_src[0] + offset, n);
+            words_or_u64(&u64_dst[0] + offset, &u64_src[0] + offset, n);
+            mismatches += (u8_dst != u8_ref) + (i32_dst != i32_ref) + (u64_dst != u64_ref);
+            mismatches += (words_popcount_u64(&u64_dst[0] + offset, n) != popcount);
+        }
+    }
+    printf("register kernels:\tlengths 0..%d at 3 alignments, %d results differ from scalar loops%s\n",
+           max_len, mismatches, mismatches ? " MISMATCH" : "");
+}
+
+/* The batch hash must match the scalar MurmurHash3_x64_128 for every tail length and for
+ * batches that leave keys over for the scalar loop. Every key sits at the very end of its
+ * own allocation, so a tail load reading past the key shows up under valgrind or ASan */
+void murmur_batch_test() {
+    const int max_len = 70;
+    const int max_batch = 37;
+    int mismatches = 0, n_hashed = 0;
+    srand(12345);
+    for (int n = 1; n <= max_batch; n++) {
+        for (int round = 0; round < 8; round++) {
+            std::vector<char *> buffers(n);
+            std::vector<const void *> keys(n);
+            std::vector<int> lengths(n);
+            std::vector<uint64_t> hashes(n);
+            uint32_t seed = rand();
+            for (int i = 0; i < n; i++) {
+                // walk through all lengths so that every tail length meets every lane
+                lengths[i] = (n * 8 + round * 5 + i) % (max_len + 1);
+                buffers[i] = new char[lengths[i] + 1] + 1;
+                for (int j = 0; j < lengths[i]; j++) {
+                    buffers[i][j] = rand();
+                }
+                keys[i] = buffers[i];
+            }
+            MurmurHash3_x64_64_batch(&keys[0], &lengths[0], n, seed, &hashes[0]);
+            for (int i = 0; i < n; i++) {
+                uint64_t expected[2];
+                MurmurHash3_x64_128(keys[i], lengths[i], seed, expected);
+                mismatches += (hashes[i] != expected[0]);
+                n_hashed++;
+                delete[] (buffers[i] - 1);
+            }
+        }
+    }
+    printf("MurmurHash3_x64_64_batch:\t%d keys of 0..%d bytes in batches of 1..%d, %d differ from MurmurHash3_x64_128%s\n",
+           n_hashed, max_len, max_batch, mismatches, mismatches ? " MISMATCH" : "");
+}
+
+/* The test vectors shipped with the reference wyhash: message i hashed with seed i */
+void wyhash_test() {
+    static const struct { const char *message; uint64_t hash; } vectors[] = {
+        { "", 0x0409638ee2bde459ULL },
+        { "a", 0xa8412d091b5fe0a9ULL },
+        { "abc", 0x32dd92e4b2915153ULL },
+        { "message digest", 0x8619124089a3a16bULL },
+        { "abcdefghijklmnopqrstuvwxyz", 0x7a43afb61d7f5f40ULL },
+        { "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", 0xff42329b90e50d58ULL },
+        { "12345678901234567890123456789012345678901234567890123456789012345678901234567890", 0xc39cab13b115aad3ULL },
+    };
+    const int n = sizeof(vectors) / sizeof(vectors[0]);
+    int mismatches = 0;
+    for (int i = 0; i < n; i++) {
+        mismatches += (wyhash(vectors[i].message, strlen(vectors[i].message), i) != vectors[i].hash);
+    }
+    printf("wyhash:\t%d reference vectors, %d differ%s\n", n, mismatches, mismatches ? " MISMATCH" : "");
+}
+
+/* Time per key of each hash family for decimal ids and a few fixed key lengths,
+ * plus the HyperLogLog error it gives on the decimal ids */
+void benchmark_hashes() {
+    const int hash_ids[] = { HASH_MURMUR3, HASH_WYHASH };
+    const int key_lengths[] = { 0, 8, 16, 36, 64 }; // 0: decimal ids
+    const int n_keys = 1024;
+    const int n_rounds = 20000;
+    char buf[n_keys][80];
+    const char *keys[n_keys];
+    int lengths[n_keys];
+    uint64_t hashes[n_keys];
+    struct timeval t0, t1;
+    int i, r;
+
+    for (size_t h = 0; h < sizeof(hash_ids) / sizeof(hash_ids[0]); h++) {
+        const HashFunction *hasher = get_hash_function(hash_ids[h]);
+        for (size_t l = 0; l < sizeof(key_lengths) / sizeof(key_lengths[0]); l++) {
+            uint64_t checksum = 0;
+            for (i = 0; i < n_keys; i++) {
+                lengths[i] = sprintf(buf[i], "%u", i * 7919);
+                if (key_lengths[l] > 0) {
+                    memset(buf[i] + lengths[i], 'x', key_lengths[l] - lengths[i]);
+                    lengths[i] = key_lengths[l];
+                }
+                keys[i] = buf[i];
+            }
+            gettimeofday(&t0, NULL);
+            for (r = 0; r < n_rounds; r++) {
+                hasher->hash_batch(keys, lengths, n_keys, hashes);
+                checksum += hashes[r % n_keys];
+            }
+            gettimeofday(&t1, NULL);
+            double dt = (t1.tv_sec - t0.tv_sec) + (double(t1.tv_usec - t0.tv_usec) / 1000000.0);
+            printf("%s\tkey length %d:\t%.2f ns/key (%lx)\n", hasher->name, key_lengths[l],
+                   dt * 1e9 / (double(n_rounds) * n_keys), (unsigned long)(checksum & 0xff));
+        }
+
+        uint64_t values[n_keys];
+        gettimeofday(&t0, NULL);
+        for (r = 0; r < n_rounds; r++) {
+            for (i = 0; i < n_keys; i++) {
+                values[i] = (uint64_t)r * n_keys + i;
+            }
+            hasher->hash_int_batch(values, n_keys, hashes);
+        }
+        gettimeofday(&t1, NULL);
+        double dt = (t1.tv_sec - t0.tv_sec) + (double(t1.tv_usec - t0.tv_usec) / 1000000.0);
+        printf("%s\tintegers:\t%.2f ns/key\n", hasher->name, dt * 1e9 / (double(n_rounds) * n_keys));
+
+        HyperLogLogOwnArrayCounter counter(14, NULL, hash_ids[h]);
+        int n_elements = 1000000;
+        for (i = 0; i < n_elements; i++) {
+            sprintf(buf[0], "%u", i);
+            counter.increment(buf[0]);
+        }
+        int count = counter.count();
+        double err_percent = 100.0 * abs(double(count) - n_elements) / double(n_elements);
+        printf("%s\t%s:\tcount = %d (error = %.2f%%)\n", hasher->name, counter.repr().c_str(), count, err_percent);
+    }
+}
+
 void test(int n_elements) {
     char buf[50];
     int i, c;
@@ -174,11 +1021,50 @@ int main(int argc, char **argv) {
     //serializer_test();
     //return 0;
 
+    serializer_span_test();
+    murmur_batch_test();
+    wyhash_test();
+    register_kernels_test();
+    benchmark_hashes();
+
     merging_test(new LinearProbabilisticCounter(128 * 1024 * 8));
     merging_test(new KMinValuesCounter(16 * 1024));
     merging_test(new HyperLogLogCounter(15));
+    merging_test(new HyperLogLogOwnArrayCounter(15, NULL));
+    merging_test(new LinearProbabilisticOwnArrayCounter(128 * 1024 * 8, NULL));
+    merging_test(new KMinValuesOwnArrayCounter(16 * 1024, NULL));
+
+    storage_test();
+    in_place_test<HyperLogLogOwnArrayCounter, HyperLogLogView>(12);
+    in_place_test<LinearProbabilisticOwnArrayCounter, LinearProbabilisticCounterView>(1 << 18);
+    in_place_test<KMinValuesOwnArrayCounter, KMinValuesView>(4096);
+    exact_test(13);
+    fold_test(10, 14);
+    fold_test(4, 12);
+    fold_test(4, 6);
+    packing_test(12, 2000);
+    packing_test(14, 1000000);
+    view_test<LinearProbabilisticCounter, LinearProbabilisticCounterView>(new LinearProbabilisticCounter(128 * 1024 * 8));
+    view_test<KMinValuesCounter, KMinValuesView>(new KMinValuesCounter(16 * 1024));
+    view_test<HyperLogLogOwnArrayCounter, HyperLogLogView>(new HyperLogLogOwnArrayCounter(12, NULL));
+    view_test<LinearProbabilisticOwnArrayCounter, LinearProbabilisticCounterView>(
+        new LinearProbabilisticOwnArrayCounter(128 * 1024 * 8, NULL));
+    view_test<KMinValuesOwnArrayCounter, KMinValuesView>(new KMinValuesOwnArrayCounter(16 * 1024, NULL));
+    duplicates_test(new KMinValuesCounter(16 * 1024));
+    duplicates_test(new KMinValuesCounter(1024 * 1024));
+    overlap_test(4096);
+    prehashed_test(14);
+    runs_test(14);
+    hash_memo_test(20);
+    hash_memo_test(300);
+    hash_memo_test(4000000);
+    bias_test(12);
+    sketch_store_test(12);
 
     benchmark();
+    benchmark_batch();
+    benchmark_int_batch();
+    benchmark_precision();
     return 0;
 
     test(100);
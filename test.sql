@@ -2,6 +2,60 @@
 CREATE LIBRARY CardinalityEstimators AS :libfile;
 CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
 NAME 'EstimateCountDistinctFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctIntFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctFloatFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctDateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctTimestampFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctTimestampTzFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctNumericFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_count_distinct_hashed AS LANGUAGE 'C++'
+NAME 'EstimateCountDistinctHashedFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchIntFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchFloatFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchDateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchTimestampFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchTimestampTzFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_sketch AS LANGUAGE 'C++'
+NAME 'HllSketchNumericFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION hll_merge AS LANGUAGE 'C++'
+NAME 'HllMergeFactory' LIBRARY CardinalityEstimators;
+CREATE FUNCTION hll_estimate AS LANGUAGE 'C++'
+NAME 'HllEstimateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchIntFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchFloatFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchDateFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchTimestampFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchTimestampTzFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_sketch AS LANGUAGE 'C++'
+NAME 'KmvSketchNumericFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION kmv_merge AS LANGUAGE 'C++'
+NAME 'KmvMergeFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_union AS LANGUAGE 'C++'
+NAME 'EstimateUnionFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_intersection AS LANGUAGE 'C++'
+NAME 'EstimateIntersectionFactory' LIBRARY CardinalityEstimators;
+CREATE AGGREGATE FUNCTION estimate_jaccard AS LANGUAGE 'C++'
+NAME 'EstimateJaccardFactory' LIBRARY CardinalityEstimators;
 
 CREATE TABLE T (x INTEGER, y NUMERIC(5,2), z VARCHAR(10));
 COPY T FROM STDIN DELIMITER ',';
@@ -21,5 +75,39 @@ SELECT x, sum(y), count(z), estimate_count_distinct(z) as est_count
 FROM T
 GROUP BY x;
 
+SELECT z, estimate_count_distinct(x) as est_x, estimate_count_distinct(y) as est_y,
+       estimate_count_distinct(y::float) as est_y_float
+FROM T
+GROUP BY z;
+
+SELECT x, estimate_count_distinct(z USING PARAMETERS precision=10) AS est_hll10,
+       estimate_count_distinct(z USING PARAMETERS precision=16) AS est_hll16,
+       estimate_count_distinct(z USING PARAMETERS estimator='linear') AS est_linear,
+       estimate_count_distinct(z USING PARAMETERS estimator='kmv', precision=8) AS est_kmv,
+       estimate_count_distinct(z USING PARAMETERS hash='murmur3') AS est_murmur3
+FROM T
+GROUP BY x;
+
+SELECT estimate_count_distinct_hashed(HASH(z)) AS est_hashed,
+       estimate_count_distinct_hashed(x USING PARAMETERS mix=true) AS est_ids_mixed
+FROM T;
+
+CREATE TABLE S AS SELECT x, hll_sketch(z) AS sketch FROM T GROUP BY x;
+SELECT x, hll_estimate(sketch) AS est_count FROM S ORDER BY x;
+SELECT hll_estimate(hll_merge(sketch)) AS est_count_all FROM S;
+SELECT hll_estimate(hll_merge(sketch)) AS est_count_all_murmur3
+FROM (SELECT x, hll_sketch(z USING PARAMETERS hash='murmur3') AS sketch FROM T GROUP BY x) AS murmur3;
+SELECT count(DISTINCT z) AS exact_count_all FROM T;
+DROP TABLE S;
+
+CREATE TABLE K AS SELECT z, kmv_sketch(x) AS sketch FROM T GROUP BY z;
+SELECT estimate_union(sketch) AS est_union, estimate_intersection(sketch) AS est_intersection,
+       estimate_jaccard(sketch) AS est_jaccard
+FROM K WHERE z IN ('B', 'C');
+SELECT count(DISTINCT b.x) AS exact_intersection
+FROM T b JOIN T c ON b.x = c.x WHERE b.z = 'B' AND c.z = 'C';
+SELECT estimate_union(sketch) AS est_count_all FROM (SELECT kmv_merge(sketch) AS sketch FROM K) AS merged;
+DROP TABLE K;
+
 DROP TABLE T;
 DROP LIBRARY CardinalityEstimators CASCADE;